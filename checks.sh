@@ -0,0 +1,391 @@
+#!/bin/sh
+# Scripted checks for my_copy: run "make check" (or "sh checks.sh")
+#
+# Each check copies files in a scratch directory and compares the
+# result with standard tools. Prints PASS/FAIL (or SKIP when this
+# machine cannot run a check) and exits with status 1 if any check
+# failed.
+
+MY_COPY="$(pwd)/my_copy"
+WORK=$(mktemp -d) || exit 1
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+
+# Never read or write the user's real profile cache
+MY_COPY_PROFILES="$WORK/profiles"
+export MY_COPY_PROFILES
+
+failed=0
+
+pass() {
+    echo "PASS: $1"
+}
+
+fail() {
+    echo "FAIL: $1"
+    failed=1
+}
+
+skip() {
+    echo "SKIP: $1"
+}
+
+# Test data: 3 MB of random bytes plus a short tail, so the last block is partial
+head -c 3000000 /dev/urandom > source.bin
+echo "tail" >> source.bin
+
+# --calibrate must not rewrite a profile cache it could not read whole,
+# and a value option given last is a usage error, not an unknown option
+check_profiles() {
+    i=0
+    while [ $i -lt 300 ]; do
+        echo "$((1000 + i)) 65536 100000"
+        i=$((i + 1))
+    done > profiles
+    cp profiles profiles.before
+    "$MY_COPY" --calibrate . > /dev/null 2>&1
+    "$MY_COPY" --calibrate 2> calibrate.err
+    if cmp -s profiles profiles.before && grep -q "needs a value" calibrate.err; then
+        pass "--calibrate keeps an oversized profile cache"
+    else
+        fail "--calibrate keeps an oversized profile cache"
+    fi
+    rm -f profiles profiles.before
+}
+
+check_profiles
+
+# A copy that cannot fit is refused before the destination is created,
+# but a device destination (/dev/null) is not checked against /dev
+check_preflight() {
+    avail=$(df -Pk . | awk 'NR == 2 { print $4 }')
+    truncate -s $(((avail + 1048576) * 1024)) huge.bin || {
+        skip "preflight (cannot create a sparse file)"
+        return
+    }
+    "$MY_COPY" huge.bin huge.copy > /dev/null 2> preflight.err
+    if [ $? -ne 1 ] || [ -e huge.copy ] || ! grep -q "Not enough space" preflight.err; then
+        fail "preflight refuses a copy that cannot fit"
+    else
+        pass "preflight refuses a copy that cannot fit"
+    fi
+    rm -f huge.bin
+
+    dev_avail=$(df -Pk /dev | awk 'NR == 2 { print $4 }')
+    if [ "$dev_avail" -gt 4194304 ]; then
+        skip "preflight ignores device destinations (/dev has too much space)"
+        return
+    fi
+    truncate -s $(((dev_avail + 65536) * 1024)) sparse.bin
+    if echo y | "$MY_COPY" sparse.bin /dev/null > /dev/null; then
+        pass "preflight ignores device destinations"
+    else
+        fail "preflight ignores device destinations"
+    fi
+    rm -f sparse.bin
+}
+
+check_preflight
+
+# --snapshot copies from a reflinked clone (needs btrfs, XFS, ...)
+check_snapshot() {
+    "$MY_COPY" --snapshot source.bin snapshot.bin > /dev/null 2> snapshot.err
+    if grep -q "reflink support" snapshot.err; then
+        skip "--snapshot (no reflink support here)"
+    elif cmp -s source.bin snapshot.bin; then
+        pass "--snapshot copy"
+    else
+        fail "--snapshot copy"
+    fi
+}
+
+check_snapshot
+
+# --cache-report prints the rise of Dirty over the baseline
+check_cache_report() {
+    if [ ! -r /proc/meminfo ]; then
+        skip "--cache-report (no /proc/meminfo)"
+        return
+    fi
+    "$MY_COPY" --cache-report source.bin report.bin > report.out
+    if grep -q "Peak dirty added:" report.out && cmp -s source.bin report.bin; then
+        pass "--cache-report"
+    else
+        fail "--cache-report"
+    fi
+}
+
+check_cache_report
+
+# A source that is in the page cache is copied from memory (mmap)
+check_mapped() {
+    cat source.bin > /dev/null
+    if "$MY_COPY" source.bin mapped.bin > /dev/null && cmp -s source.bin mapped.bin; then
+        pass "copy of a cached source"
+    else
+        fail "copy of a cached source"
+    fi
+}
+
+check_mapped
+
+# --stage-dir returns at once; the background drain moves the file
+check_stage() {
+    mkdir stage
+    "$MY_COPY" --stage-dir stage source.bin staged.bin > /dev/null || {
+        fail "--stage-dir copy"
+        return
+    }
+    tries=0
+    while ls stage/.my_copy-stage-* > /dev/null 2>&1 && [ $tries -lt 100 ]; do
+        sleep 0.1
+        tries=$((tries + 1))
+    done
+    if cmp -s source.bin staged.bin && [ ! -s stage/my_copy-drain.log ]; then
+        pass "--stage-dir drain"
+    else
+        fail "--stage-dir drain"
+    fi
+}
+
+check_stage
+
+# --parity 2+1, then damage one 64 KB block in two stripes (keeping the
+# mtime, as bit rot does): --repair must rebuild the copy exactly. A copy
+# without --parity over it must delete the stale parity, and a file that
+# was rewritten must be refused.
+check_parity() {
+    "$MY_COPY" --parity 2+1 source.bin parity.bin > /dev/null || {
+        fail "--parity copy"
+        return
+    }
+    touch -r parity.bin parity.time
+    dd if=/dev/zero of=parity.bin bs=65536 seek=1 count=1 conv=notrunc 2> /dev/null
+    dd if=/dev/urandom of=parity.bin bs=65536 seek=4 count=1 conv=notrunc 2> /dev/null
+    touch -r parity.time parity.bin
+    if cmp -s source.bin parity.bin; then
+        fail "--parity test setup did not damage the copy"
+        return
+    fi
+    if "$MY_COPY" --repair parity.bin > /dev/null && cmp -s source.bin parity.bin; then
+        pass "--parity/--repair round-trip"
+    else
+        fail "--parity/--repair round-trip"
+    fi
+
+    echo "other data" > other.bin
+    echo y | "$MY_COPY" other.bin parity.bin > /dev/null
+    if [ -e parity.bin.par1 ]; then
+        fail "a copy without --parity removes stale parity files"
+    else
+        pass "a copy without --parity removes stale parity files"
+    fi
+
+    "$MY_COPY" --parity 2+1 other.bin rewritten.bin > /dev/null
+    echo "rewritten" > rewritten.bin
+    if "$MY_COPY" --repair rewritten.bin > /dev/null 2>&1 ||
+       [ "$(cat rewritten.bin)" != "rewritten" ]; then
+        fail "--repair refuses a rewritten file"
+    else
+        pass "--repair refuses a rewritten file"
+    fi
+}
+
+check_parity
+
+# --replica: stripes from the source and an identical copy make up the
+# file; a replica with another mtime is refused
+check_replica() {
+    cp source.bin replica.bin
+    touch -r source.bin replica.bin
+    if "$MY_COPY" --replica replica.bin source.bin replicated.bin > /dev/null &&
+       cmp -s source.bin replicated.bin; then
+        pass "--replica copy"
+    else
+        fail "--replica copy"
+    fi
+    touch -d "2001-01-01" replica.bin
+    if "$MY_COPY" --replica replica.bin source.bin mismatched.bin > /dev/null 2>&1; then
+        fail "--replica refuses a different copy"
+    else
+        pass "--replica refuses a different copy"
+    fi
+}
+
+check_replica
+
+# --shard with --leases: two workers copy a 150 MB file (3 chunks)
+# together; an unrelated existing destination still gets the prompt
+check_shard() {
+    head -c 150000000 /dev/urandom > shard.src
+    "$MY_COPY" --shard 0/2 --leases shard.src shard.bin > /dev/null &
+    "$MY_COPY" --shard 1/2 --leases shard.src shard.bin > /dev/null
+    status=$?
+    wait $! || status=1
+    if [ $status -eq 0 ] && cmp -s shard.src shard.bin && [ ! -e shard.bin.leases ]; then
+        pass "--shard --leases"
+    else
+        fail "--shard --leases"
+    fi
+    rm -f shard.src shard.bin
+
+    echo "keep me" > foreign.bin
+    echo n | "$MY_COPY" --shard 0/2 source.bin foreign.bin > /dev/null
+    if [ "$(cat foreign.bin)" = "keep me" ]; then
+        pass "--shard asks before overwriting another file"
+    else
+        fail "--shard asks before overwriting another file"
+    fi
+}
+
+check_shard
+
+# --simulate-device prints the modelled device time; with --replica the
+# stripes are read through the model too, one device per copy
+check_simulate() {
+    "$MY_COPY" --simulate-device 100,0,1000 source.bin simulated.bin > simulate.out
+    if grep -q "Simulated device time" simulate.out && cmp -s source.bin simulated.bin; then
+        pass "--simulate-device"
+    else
+        fail "--simulate-device"
+    fi
+    cp source.bin modelled.bin
+    touch -r source.bin modelled.bin
+    "$MY_COPY" --replica modelled.bin --simulate-device 100,0,1000 \
+        source.bin replicas-modelled.bin > replicas.out
+    if grep -q "busiest of 2 copies" replicas.out && cmp -s source.bin replicas-modelled.bin; then
+        pass "--simulate-device with --replica"
+    else
+        fail "--simulate-device with --replica"
+    fi
+}
+
+check_simulate
+
+# --quiet prints nothing on success; without it the line goes to a pipe too
+check_quiet() {
+    quiet_out=$("$MY_COPY" --quiet source.bin quiet1.bin 2>&1)
+    loud_out=$("$MY_COPY" source.bin quiet2.bin | cat)
+    if [ -z "$quiet_out" ] && [ "$loud_out" = "Success! Copied 'source.bin' to 'quiet2.bin'" ]; then
+        pass "--quiet and batched output"
+    else
+        fail "--quiet and batched output"
+    fi
+}
+
+check_quiet
+
+# --link-dest: an unchanged file is linked; after the source changes,
+# the re-run must copy without touching the previous generation
+check_link_dest() {
+    mkdir gen0 gen1 gen2
+    echo "version 1" > linked.txt
+    "$MY_COPY" --quiet --link-dest gen0 linked.txt gen1/linked.txt
+    "$MY_COPY" --quiet --link-dest gen1 linked.txt gen2/linked.txt
+    if [ "$(stat -c %h gen1/linked.txt)" != 2 ]; then
+        fail "--link-dest links an unchanged file"
+        return
+    fi
+    echo "version 2 - changed" > linked.txt
+    echo y | "$MY_COPY" --quiet --link-dest gen1 linked.txt gen2/linked.txt > /dev/null
+    if [ "$(cat gen1/linked.txt)" = "version 1" ] && cmp -s linked.txt gen2/linked.txt; then
+        pass "--link-dest re-run keeps the previous generation"
+    else
+        fail "--link-dest re-run keeps the previous generation"
+    fi
+}
+
+check_link_dest
+
+# --rescue through a simulated bad area: the first run must fail and
+# record the area in the map, a resumed run without it must finish. With
+# --replica instead, the bad stripes come from the replica.
+check_rescue() {
+    "$MY_COPY" --quiet --rescue rescue.map --simulate-device 0,0,1000,1000000+5000 \
+        source.bin rescue.bin > /dev/null 2>&1
+    if [ $? -ne 1 ] || ! grep -q "^bad " rescue.map; then
+        fail "--rescue reports the bad area"
+    elif "$MY_COPY" --quiet --rescue rescue.map source.bin rescue.bin > /dev/null &&
+         cmp -s source.bin rescue.bin; then
+        pass "--rescue with a bad area, then resumed"
+    else
+        fail "--rescue with a bad area, then resumed"
+    fi
+    cp source.bin failover.bin
+    touch -r source.bin failover.bin
+    if "$MY_COPY" --quiet --replica failover.bin --simulate-device 0,0,1000,1000000+5000 \
+           source.bin failed-over.bin > /dev/null 2>&1 &&
+       cmp -s source.bin failed-over.bin; then
+        pass "--replica failover around a bad area"
+    else
+        fail "--replica failover around a bad area"
+    fi
+}
+
+check_rescue
+
+# --verify sample: spot-checks the copy and prints the confidence bound
+check_verify() {
+    if "$MY_COPY" --verify sample:50 source.bin verified.bin > verify.out &&
+       grep -q "95% confidence" verify.out && cmp -s source.bin verified.bin; then
+        pass "--verify sample"
+    else
+        fail "--verify sample"
+    fi
+}
+
+check_verify
+
+# --sha256 prints a sha256sum line for the copy, with the source's digest,
+# escaped the same way for names with a backslash, newline or CR
+check_sha256() {
+    "$MY_COPY" --quiet --sha256 source.bin sha.bin > sha.out || {
+        fail "--sha256 copy"
+        return
+    }
+    expected=$(sha256sum source.bin | cut -d' ' -f1)
+    if [ "$(cut -d' ' -f1 sha.out)" = "$expected" ] &&
+       sha256sum -c sha.out > /dev/null && cmp -s source.bin sha.bin; then
+        pass "--sha256 matches sha256sum"
+    else
+        fail "--sha256 matches sha256sum"
+    fi
+
+    odd=$(printf 'cr\rnl\nbs\\.bin')
+    "$MY_COPY" --quiet --sha256 source.bin "$odd" > odd.out
+    sha256sum "$odd" > odd.expected
+    if cmp -s odd.out odd.expected; then
+        pass "--sha256 escapes names like sha256sum"
+    else
+        fail "--sha256 escapes names like sha256sum"
+    fi
+}
+
+check_sha256
+
+# With --quiet, a copy to /dev/stdout is the bare data (no prompt, no status)
+check_stdout() {
+    if "$MY_COPY" --quiet source.bin /dev/stdout < /dev/null | cmp -s - source.bin; then
+        pass "copy to /dev/stdout"
+    else
+        fail "copy to /dev/stdout"
+    fi
+}
+
+check_stdout
+
+# --analyze: zeros have no entropy, an empty file has nothing to measure
+check_analyze() {
+    head -c 1000000 /dev/zero > zeros.bin
+    : > empty.bin
+    if "$MY_COPY" --analyze zeros.bin | grep -q "Entropy: *0.00 bits" &&
+       "$MY_COPY" --analyze empty.bin | grep -q "Entropy: *n/a"; then
+        pass "--analyze"
+    else
+        fail "--analyze"
+    fi
+}
+
+check_analyze
+
+exit $failed
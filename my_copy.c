@@ -1,17 +1,143 @@
 /*
  * my_copy.c - File copy program using system calls
  * 
- * Version 3: Added destination file existence check and user confirmation
+ * Version 17: Added --analyze to report copy-relevant file characteristics
  * 
- * Usage: ./my_copy <source_file> <destination_file>
+ * Usage: ./my_copy [--quiet] [--snapshot] [--cache-report] [--stage-dir <dir> [--drain-rate <MB/s>]]
+ *                  [--parity <K+M>] [--replica <copy_of_source>]...
+ *                  [--shard <I/N> [--leases]] [--simulate-device <lat_us,seek_us_per_gb,MB/s>]
+ *                  [--link-dest <previous_backup_dir> [--link-compare]] [--rescue <map_file>]
+ *                  [--verify sample:<percent>[:<seed>]] [--sha256]
+ *                  <source_file> <destination_file>
+ *        ./my_copy --repair <file>
+ *        ./my_copy --calibrate <directory>
+ *        ./my_copy --analyze <file>
  * 
  * Uses ONLY system calls - no standard C library functions like printf/fopen!
  */
 
+#define _GNU_SOURCE  // for O_TMPFILE, plus clock_gettime(), fdatasync()
+
 #include <unistd.h>    // for read(), write(), close(), access()
 #include <fcntl.h>     // for open(), O_RDONLY, O_WRONLY, O_CREAT, O_TRUNC
+#include <sys/stat.h>  // for fstat(), stat(), struct stat
+#include <sys/statvfs.h>  // for statvfs() - free space and inodes
+#include <time.h>      // for clock_gettime(), CLOCK_MONOTONIC
+#include <stdio.h>     // for rename() only - no printf()/fopen()!
+#include <sys/ioctl.h> // for ioctl()
+#include <linux/fs.h>  // for FICLONE (reflink a whole file)
+#include <sys/mman.h>  // for mmap(), mincore(), munmap()
+#include <sys/uio.h>   // for writev(), struct iovec
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // for SSSE3/AVX2 PSHUFB (GF(2^8) multiply in --parity), SHA-NI
+#include <cpuid.h>     // for __get_cpuid_count() - SHA-NI detection
+#endif
+#if defined(__aarch64__) && defined(__ARM_FEATURE_SHA2)
+#include <arm_neon.h>  // for the ARMv8 SHA-256 instructions
+#endif
 
 #define BUFFER_SIZE 4096  // 4 KB buffer (optimal for most systems)
+#define MAX_BUFFER_SIZE (1024 * 1024)  // Largest request size a profile may select
+#define PATH_LENGTH 4096  // Room for paths we build ourselves
+#define MESSAGE_PARTS 16  // Most pieces one status message can have
+#define OUTPUT_BUFFER_SIZE 8192  // Batched stdout lines (see flush_output())
+
+/*
+ * Calibration settings
+ * 
+ * --calibrate writes CALIBRATE_BYTES to a scratch file once for every
+ * candidate request size and keeps the fastest one.
+ */
+#define CALIBRATE_BYTES (16 * 1024 * 1024)
+#define PROFILE_FILE_SIZE 4096  // Profile cache is tiny: one line per device
+
+/*
+ * Cache report settings (--cache-report)
+ * 
+ * /proc/meminfo is sampled every CACHE_SAMPLE_BYTES copied, and files are
+ * mapped CACHE_WINDOW bytes at a time when counting resident pages.
+ */
+#define CACHE_SAMPLE_BYTES (64ULL * 1024 * 1024)
+#define CACHE_WINDOW (64ULL * 1024 * 1024)
+#define MEMINFO_SIZE 8192
+
+/*
+ * Copy strategy thresholds (see choose_strategy())
+ */
+#define CACHED_PERCENT 95   // At least this much cached: copy from memory
+#define COLD_PERCENT 10     // Less than this cached...
+#define DIRECT_MIN_BYTES (256ULL * 1024 * 1024)  // ...and this big: O_DIRECT
+#define DIRECT_ALIGN 4096   // O_DIRECT needs aligned buffers and sizes
+#define DROP_WINDOW (64ULL * 1024 * 1024)  // Destination pages dropped per step
+
+/*
+ * Staging settings (--stage-dir)
+ * 
+ * A staged copy only starts when it fits in the staging filesystem while
+ * still leaving STAGE_RESERVE_PERCENT of it free. Otherwise we wait for
+ * background drains to make room, for at most STAGE_WAIT_SECONDS.
+ */
+#define STAGE_RESERVE_PERCENT 10
+#define STAGE_WAIT_SECONDS 600
+#define DRAIN_LOG "my_copy-drain.log"  // Background drain errors, in the staging dir
+
+/*
+ * Parity settings (--parity K+M)
+ */
+#define PARITY_BLOCK (64 * 1024)  // Bytes per data/parity block
+#define MAX_DATA_BLOCKS 32        // Largest K
+#define MAX_PARITY_BLOCKS 16      // Largest M
+
+/*
+ * Replica settings (--replica)
+ */
+#define MAX_REPLICAS 8            // Source plus up to 7 --replica copies
+#define REPLICA_READAHEAD 2       // Stripes prefetched per replica
+#define REPLICA_SLOW_FACTOR 4     // Drop replicas this many times slower...
+#define REPLICA_MIN_SAMPLES (16ULL * 1024 * 1024)  // ...once each read this much
+
+/*
+ * Shard settings (--shard I/N)
+ */
+#define SHARD_CHUNK (64ULL * 1024 * 1024)  // Unit of work handed to a shard
+
+/*
+ * Rescue settings (--rescue MAPFILE)
+ *
+ * The first pass reads MAX_BUFFER_SIZE at a time and, after each read
+ * error, skips ahead twice as far as last time (up to RESCUE_MAX_SKIP).
+ * Retry passes read the bad areas again in RESCUE_RETRY_BLOCK pieces,
+ * halving the piece size every pass down to one RESCUE_MIN_BLOCK sector.
+ */
+#define RESCUE_MAX_SKIP (64ULL * 1024 * 1024)
+#define RESCUE_RETRY_BLOCK (64 * 1024)
+#define RESCUE_MIN_BLOCK 512
+#define RESCUE_MAX_REGIONS 4096   // Bad areas remembered (more get merged)
+#define RESCUE_SAVE_SECONDS 5     // Map file rewritten at least this often
+#define RESCUE_MAP_SIZE (RESCUE_MAX_REGIONS * 48 + 128)
+
+/*
+ * Sampled verification settings (--verify sample:P)
+ */
+#define VERIFY_BLOCK (256 * 1024)  // Unit that is picked or skipped
+#define VERIFY_QUEUE_DEPTH 32      // Sampled blocks requested ahead
+#define VERIFY_LN_MISS_MILLI 2996  // ln(1/5%) = 2.9957, in 1/1000ths rounded up: 95% confidence
+
+/*
+ * Analysis settings (--analyze)
+ */
+#define ANALYZE_SAMPLES 256               // Pieces of the file read
+#define ANALYZE_SAMPLE_BYTES (64 * 1024)  // Size of each piece
+#define ANALYZE_PAGE 4096                 // Unit for zero/duplicate counting
+#define ANALYZE_MAX_SHARDS 8              // Most processes we suggest
+#define LOG2_ONE 65536                    // log2_fixed() works in 1/65536ths
+
+/*
+ * The copy buffer lives in static storage (not on the stack) because a
+ * calibrated profile may ask for up to 1 MB per request. It is page
+ * aligned so it can also be used for O_DIRECT reads.
+ */
+static char buffer[MAX_BUFFER_SIZE] __attribute__((aligned(DIRECT_ALIGN)));
 
 /*
  * Helper function: Calculate string length
@@ -25,36 +151,4095 @@ int string_length(const char *str) {
     while (str[len] != '\0') {
         len++;
     }
-    return len;
+    return len;
+}
+
+/*
+ * Helper function: Compare two strings
+ *
+ * Replacement for strcmp() - returns 1 if equal, 0 otherwise
+ */
+int strings_equal(const char *a, const char *b) {
+    int i = 0;
+    while (a[i] != '\0' && a[i] == b[i]) {
+        i++;
+    }
+    return a[i] == b[i];
+}
+
+/*
+ * Helper function: Append src to dest at position pos
+ *
+ * Returns the new end position, or -1 if the result would not fit
+ * in PATH_LENGTH bytes (including the '\0').
+ */
+int append_string(char *dest, int pos, const char *src) {
+    if (pos < 0) {
+        return -1;
+    }
+    int i = 0;
+    while (src[i] != '\0') {
+        if (pos >= PATH_LENGTH - 1) {
+            return -1;
+        }
+        dest[pos++] = src[i++];
+    }
+    dest[pos] = '\0';
+    return pos;
+}
+
+/*
+ * Helper function: Convert a number to decimal text
+ *
+ * Replacement for sprintf("%llu") - writes the digits into out
+ * (no '\0') and returns how many characters were written.
+ * out must have room for 20 characters.
+ */
+int format_number(unsigned long long value, char *out) {
+    char digits[20];
+    int count = 0;
+    do {
+        digits[count++] = '0' + (value % 10);
+        value /= 10;
+    } while (value > 0);
+
+    for (int i = 0; i < count; i++) {
+        out[i] = digits[count - 1 - i];
+    }
+    return count;
+}
+
+/*
+ * Helper function: Write a number in decimal to a file descriptor
+ */
+void write_number(int fd, unsigned long long value) {
+    char text[20];
+    write(fd, text, format_number(value, text));
+}
+
+/*
+ * Helper function: Append a number in decimal to dest at position pos
+ *
+ * Same return value as append_string().
+ */
+int append_number(char *dest, int pos, unsigned long long value) {
+    char text[21];
+    text[format_number(value, text)] = '\0';
+    return append_string(dest, pos, text);
+}
+
+/*
+ * ========================================================================
+ * Status output
+ * ========================================================================
+ *
+ * Messages are built from parts and sent as ONE writev() system call
+ * instead of one write() per part, so a line is never torn apart by
+ * other output:
+ *
+ *     message_begin();
+ *     message_text("Error: Cannot open '");
+ *     message_text(name);
+ *     message_text("'\n");
+ *     message_send(STDERR_FILENO);
+ *
+ * Everything goes through here, errors included (error_message() for a
+ * fixed text). stderr lines go out immediately. stdout lines go out
+ * immediately on a terminal (someone is watching), but are collected in
+ * output_buffer when stdout is a pipe or file and written in batches by
+ * flush_output() - one write() for many lines. Batched lines are flushed
+ * before anything else is written, so the order is always kept.
+ */
+struct message {
+    struct iovec parts[MESSAGE_PARTS];
+    int count;
+    int overflow;                     // Parts beyond MESSAGE_PARTS were given
+    char numbers[MESSAGE_PARTS][20];  // Text of numbers added to this message
+};
+
+static struct message current_message;
+static char output_buffer[OUTPUT_BUFFER_SIZE];
+static int output_used = 0;
+static int output_is_terminal = -1;  // -1 = not checked yet
+static int quiet = 0;                // --quiet: no success/progress lines
+
+void message_begin(void) {
+    current_message.count = 0;
+    current_message.overflow = 0;
+}
+
+void message_text(const char *text) {
+    if (current_message.count < MESSAGE_PARTS) {
+        struct iovec *part = &current_message.parts[current_message.count++];
+        part->iov_base = (void *)text;
+        part->iov_len = (size_t)string_length(text);
+    }
+    else {
+        current_message.overflow = 1;
+    }
+}
+
+void message_number(unsigned long long value) {
+    if (current_message.count < MESSAGE_PARTS) {
+        char *text = current_message.numbers[current_message.count];
+        struct iovec *part = &current_message.parts[current_message.count++];
+        part->iov_base = text;
+        part->iov_len = (size_t)format_number(value, text);
+    }
+    else {
+        current_message.overflow = 1;
+    }
+}
+
+/*
+ * Write out all batched stdout lines (one write() call)
+ *
+ * Must be called before anything that waits (reading the user's answer,
+ * sleeping, a long phase whose progress line should be seen now) and
+ * before fork(), or the child would print them again.
+ */
+void flush_output(void) {
+    if (output_used > 0) {
+        write(STDOUT_FILENO, output_buffer, output_used);
+        output_used = 0;
+    }
+}
+
+void message_send(int fd) {
+    struct message *m = &current_message;
+
+    if (fd == STDOUT_FILENO) {
+        if (output_is_terminal == -1) {
+            output_is_terminal = isatty(STDOUT_FILENO);
+        }
+        size_t length = 0;
+        for (int i = 0; i < m->count; i++) {
+            length += m->parts[i].iov_len;
+        }
+        if (!output_is_terminal && length <= OUTPUT_BUFFER_SIZE) {
+            if (output_used + length > OUTPUT_BUFFER_SIZE) {
+                flush_output();
+            }
+            for (int i = 0; i < m->count; i++) {
+                const char *text = m->parts[i].iov_base;
+                for (size_t j = 0; j < m->parts[i].iov_len; j++) {
+                    output_buffer[output_used++] = text[j];
+                }
+            }
+            return;
+        }
+    }
+    flush_output();  // Earlier stdout lines must come out first
+    writev(fd, m->parts, m->count);
+    if (m->overflow) {
+        // A bug in the caller, not a runtime condition: make it impossible to miss
+        const char warning[] = "\nInternal error: message cut short - raise MESSAGE_PARTS\n";
+        write(STDERR_FILENO, warning, sizeof(warning) - 1);
+    }
+}
+
+/*
+ * Helper function: Send a one-part message to stderr
+ */
+void error_message(const char *text) {
+    message_begin();
+    message_text(text);
+    message_send(STDERR_FILENO);
+}
+
+/*
+ * Helper function: Parse a decimal number
+ *
+ * Replacement for strtoull() - reads digits starting at *pos and
+ * advances *pos past them. Returns -1 if there was no digit.
+ */
+int parse_number(const char *str, int *pos, unsigned long long *value) {
+    int start = *pos;
+    *value = 0;
+    while (str[*pos] >= '0' && str[*pos] <= '9') {
+        *value = *value * 10 + (unsigned long long)(str[*pos] - '0');
+        (*pos)++;
+    }
+    return (*pos == start) ? -1 : 0;
+}
+
+/*
+ * Helper function: Nanoseconds elapsed since start
+ */
+unsigned long long elapsed_ns(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)(now.tv_sec - start->tv_sec) * 1000000000ULL
+           + (unsigned long long)now.tv_nsec - (unsigned long long)start->tv_nsec;
+}
+
+/*
+ * Helper function: Check whether str begins with prefix
+ *
+ * Returns a pointer to the rest of str after the prefix,
+ * or 0 (null) if str does not start with prefix.
+ */
+const char *skip_prefix(const char *str, const char *prefix) {
+    int i = 0;
+    while (prefix[i] != '\0') {
+        if (str[i] != prefix[i]) {
+            return 0;
+        }
+        i++;
+    }
+    return str + i;
+}
+
+/*
+ * Helper function: Find the profile cache file
+ *
+ * $MY_COPY_PROFILES wins if set, otherwise $HOME/.my_copy_profiles.
+ * We get the environment through main()'s third parameter because
+ * getenv() is a standard library function.
+ *
+ * Returns 0 on success, -1 if neither variable is set.
+ */
+int find_profile_path(char *envp[], char *path) {
+    const char *home = 0;
+
+    for (int i = 0; envp[i] != 0; i++) {
+        const char *value = skip_prefix(envp[i], "MY_COPY_PROFILES=");
+        if (value != 0 && value[0] != '\0') {
+            return append_string(path, 0, value) > 0 ? 0 : -1;
+        }
+        value = skip_prefix(envp[i], "HOME=");
+        if (value != 0) {
+            home = value;
+        }
+    }
+
+    if (home == 0) {
+        return -1;
+    }
+    int pos = append_string(path, 0, home);
+    pos = append_string(path, pos, "/.my_copy_profiles");
+    return pos > 0 ? 0 : -1;
+}
+
+/*
+ * Helper function: Load the profile cache into memory
+ *
+ * The file is plain text, one line per device:
+ *     <device id> <request size in bytes> <write rate in KB/s>
+ * so it can be inspected with cat and edited by hand.
+ *
+ * A file that does not fit in PROFILE_FILE_SIZE is not cut short: the
+ * text is left empty and a warning is printed, so a partial cache is
+ * never used - or written back by save_profile().
+ *
+ * Returns the number of bytes loaded (0 if the file does not exist),
+ * or -1 if the file is too large.
+ */
+int load_profiles(const char *path, char *text) {
+    int total = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd != -1) {
+        ssize_t n;
+        while (total < PROFILE_FILE_SIZE - 1 &&
+               (n = read(fd, text + total, PROFILE_FILE_SIZE - 1 - total)) > 0) {
+            total += n;
+        }
+        char extra;
+        int too_large = total == PROFILE_FILE_SIZE - 1 && read(fd, &extra, 1) > 0;
+        close(fd);
+        if (too_large) {
+            text[0] = '\0';
+            message_begin();
+            message_text("Warning: Profile cache '");
+            message_text(path);
+            message_text("' is too large; ignoring it\n");
+            message_send(STDERR_FILENO);
+            return -1;
+        }
+    }
+    text[total] = '\0';
+    return total;
+}
+
+/*
+ * Helper function: Look up the calibrated profile for a device
+ *
+ * Stores the measured write rate (KB/s) in *rate, or 0 if the line has
+ * none (profiles written before rates were recorded).
+ *
+ * Returns the stored request size, or 0 if the device has no profile.
+ */
+unsigned long long lookup_profile(const char *text, unsigned long long device,
+                                  unsigned long long *rate) {
+    int pos = 0;
+    *rate = 0;
+    while (text[pos] != '\0') {
+        unsigned long long id;
+        unsigned long long size;
+        int ok = parse_number(text, &pos, &id) == 0;
+        while (text[pos] == ' ') {
+            pos++;
+        }
+        ok = ok && parse_number(text, &pos, &size) == 0;
+        if (ok && id == device) {
+            while (text[pos] == ' ') {
+                pos++;
+            }
+            if (parse_number(text, &pos, rate) == -1) {
+                *rate = 0;
+            }
+            return size;
+        }
+        // Skip to the next line
+        while (text[pos] != '\0' && text[pos] != '\n') {
+            pos++;
+        }
+        if (text[pos] == '\n') {
+            pos++;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Helper function: Store the calibrated request size for a device
+ *
+ * Rewrites the whole cache: every other device's line is kept, the line
+ * for this device is replaced. The new file is written next to the old
+ * one and renamed over it, so a crash never leaves a half-written cache.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int save_profile(const char *path, unsigned long long device,
+                 unsigned long long size, unsigned long long rate) {
+    char old_text[PROFILE_FILE_SIZE];
+    char tmp_path[PATH_LENGTH];
+    if (load_profiles(path, old_text) == -1) {
+        return -1;  // Rewriting it would drop the lines we could not read
+    }
+
+    int pos = append_string(tmp_path, 0, path);
+    if (append_string(tmp_path, pos, ".tmp") == -1) {
+        return -1;
+    }
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+
+    /*
+     * Copy the lines for other devices unchanged
+     */
+    int line_start = 0;
+    while (old_text[line_start] != '\0') {
+        int line_end = line_start;
+        while (old_text[line_end] != '\0' && old_text[line_end] != '\n') {
+            line_end++;
+        }
+        int num_end = line_start;
+        unsigned long long id;
+        if (parse_number(old_text, &num_end, &id) == 0 && id != device) {
+            write(fd, old_text + line_start, line_end - line_start);
+            write(fd, "\n", 1);
+        }
+        line_start = (old_text[line_end] == '\n') ? line_end + 1 : line_end;
+    }
+
+    /*
+     * Append the new line for this device
+     */
+    write_number(fd, device);
+    write(fd, " ", 1);
+    write_number(fd, size);
+    write(fd, " ", 1);
+    write_number(fd, rate);
+    ssize_t last = write(fd, "\n", 1);
+
+    if (close(fd) == -1 || last != 1 || rename(tmp_path, path) == -1) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Helper function: Get the directory part of a path
+ *
+ * "dir/file" -> "dir", "/file" -> "/", "file" -> "."
+ * Returns 0 on success, -1 if the path is too long.
+ */
+int parent_directory(const char *path, char *out) {
+    int last_slash = -1;
+    for (int i = 0; path[i] != '\0'; i++) {
+        if (path[i] == '/') {
+            last_slash = i;
+        }
+    }
+
+    if (last_slash == -1) {
+        return append_string(out, 0, ".") == -1 ? -1 : 0;
+    }
+    if (last_slash == 0) {
+        return append_string(out, 0, "/") == -1 ? -1 : 0;
+    }
+    if (last_slash >= PATH_LENGTH) {
+        return -1;
+    }
+    for (int i = 0; i < last_slash; i++) {
+        out[i] = path[i];
+    }
+    out[last_slash] = '\0';
+    return 0;
+}
+
+/*
+ * Take a point-in-time snapshot of the source (--snapshot)
+ *
+ * Clones the source into an unnamed temporary file (O_TMPFILE) in the
+ * source's own directory with the FICLONE ioctl. On copy-on-write
+ * filesystems (btrfs, XFS) the clone is O(1): it shares the source's
+ * blocks, and later writes to the source go to new blocks, so the clone
+ * keeps exactly the data as it was at this moment.
+ *
+ * The copy then reads from the clone instead of the live file, so a
+ * writer that keeps changing the source cannot give us a torn mix of old
+ * and new blocks. The clone has no name, so nobody else can see it and
+ * the kernel frees it when we close it - even if we crash.
+ *
+ * Returns the clone's file descriptor, or -1 on error.
+ */
+int snapshot_source(int source_fd, const char *source_file) {
+    char dir[PATH_LENGTH];
+    if (parent_directory(source_file, dir) == -1) {
+        error_message("Error: Source path is too long\n");
+        return -1;
+    }
+
+    int snapshot_fd = open(dir, O_TMPFILE | O_RDWR, 0600);
+    if (snapshot_fd == -1) {
+        message_begin();
+        message_text("Error: Cannot create snapshot file in '");
+        message_text(dir);
+        message_text("'\n");
+        message_send(STDERR_FILENO);
+        return -1;
+    }
+
+    if (ioctl(snapshot_fd, FICLONE, source_fd) == -1) {
+        error_message("Error: Cannot snapshot source - --snapshot needs a filesystem "
+                     "with reflink support (e.g. btrfs, XFS)\n");
+        close(snapshot_fd);
+        return -1;
+    }
+    return snapshot_fd;
+}
+
+/*
+ * Helper function: Check whether two open files have the same contents
+ *
+ * Reads both from the start, half of the copy buffer each.
+ * Returns 1 if they are identical, 0 if not (or a read fails).
+ */
+int same_contents(int fd_a, int fd_b) {
+    char *a = buffer;
+    char *b = buffer + MAX_BUFFER_SIZE / 2;
+    off_t offset = 0;
+
+    while (1) {
+        ssize_t got_a = pread(fd_a, a, MAX_BUFFER_SIZE / 2, offset);
+        if (got_a == -1) {
+            return 0;
+        }
+        ssize_t got_b = 0;
+        while (got_b < got_a) {
+            ssize_t n = pread(fd_b, b + got_b, (size_t)(got_a - got_b), offset + got_b);
+            if (n <= 0) {
+                return 0;
+            }
+            got_b += n;
+        }
+        if (got_a == 0) {
+            // Both must end here
+            return pread(fd_b, b, 1, offset) == 0;
+        }
+        for (ssize_t i = 0; i < got_a; i++) {
+            if (a[i] != b[i]) {
+                return 0;
+            }
+        }
+        offset += got_a;
+    }
+}
+
+/*
+ * Link the destination to the previous backup generation (--link-dest)
+ *
+ * The previous copy is <prev_dir>/<name of dest_file>. If it matches the
+ * source - same size and mtime, or same contents with --link-compare -
+ * the destination becomes a hard link to it: no data is read or written
+ * and the new generation costs one directory entry.
+ *
+ * The link is made under a temporary name next to dest_file and then
+ * renamed over it, so an existing destination is replaced atomically.
+ *
+ * source_stat must describe the source itself (not a --snapshot clone,
+ * whose mtime is "now").
+ *
+ * Returns 1 if linked, 0 if the file has to be copied, -1 on error.
+ */
+int link_previous(const char *prev_dir, const char *dest_file, int source_fd,
+                  const struct stat *source_stat, int compare_contents) {
+    char prev_path[PATH_LENGTH];
+    char link_path[PATH_LENGTH];
+    const char *name = dest_file;
+
+    for (int i = 0; dest_file[i] != '\0'; i++) {
+        if (dest_file[i] == '/') {
+            name = dest_file + i + 1;
+        }
+    }
+    int pos = append_string(prev_path, 0, prev_dir);
+    pos = append_string(prev_path, pos, "/");
+    if (append_string(prev_path, pos, name) == -1) {
+        error_message("Error: --link-dest path is too long\n");
+        return -1;
+    }
+
+    /*
+     * Is the previous copy still the same file as the source?
+     */
+    struct stat prev_stat;
+    if (stat(prev_path, &prev_stat) == -1 || !S_ISREG(prev_stat.st_mode) ||
+        !S_ISREG(source_stat->st_mode) || prev_stat.st_size != source_stat->st_size) {
+        return 0;  // New or changed file
+    }
+    if (compare_contents) {
+        int prev_fd = open(prev_path, O_RDONLY);
+        if (prev_fd == -1) {
+            return 0;
+        }
+        int same = same_contents(source_fd, prev_fd);
+        close(prev_fd);
+        if (!same) {
+            return 0;
+        }
+    }
+    else if (prev_stat.st_mtim.tv_sec != source_stat->st_mtim.tv_sec ||
+             prev_stat.st_mtim.tv_nsec != source_stat->st_mtim.tv_nsec) {
+        return 0;
+    }
+
+    /*
+     * Already linked (e.g. the same run repeated)? Nothing to do.
+     */
+    struct stat dest_stat;
+    if (stat(dest_file, &dest_stat) == 0 &&
+        dest_stat.st_dev == prev_stat.st_dev && dest_stat.st_ino == prev_stat.st_ino) {
+        return 1;
+    }
+
+    pos = append_string(link_path, 0, dest_file);
+    pos = append_string(link_path, pos, ".my_copy-link-");
+    if (append_number(link_path, pos, (unsigned long long)getpid()) == -1) {
+        error_message("Error: Destination path is too long\n");
+        return -1;
+    }
+    if (linkat(AT_FDCWD, prev_path, AT_FDCWD, link_path, 0) == -1) {
+        /*
+         * Different filesystem (EXDEV), too many links, ... - a plain
+         * copy still gives a correct backup
+         */
+        message_begin();
+        message_text("Warning: Cannot link to '");
+        message_text(prev_path);
+        message_text("' - copying instead\n");
+        message_send(STDERR_FILENO);
+        return 0;
+    }
+    if (rename(link_path, dest_file) == -1) {
+        unlink(link_path);
+        message_begin();
+        message_text("Error: Cannot replace '");
+        message_text(dest_file);
+        message_text("'\n");
+        message_send(STDERR_FILENO);
+        return -1;
+    }
+    return 1;
+}
+
+/*
+ * Helper function: Give a --link-dest copy its own inode
+ *
+ * A destination left by an earlier run may still be a hard link into an
+ * older generation. Truncating and rewriting it in place would change
+ * that backup as well, so it is unlinked and the copy creates a new file.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int unshare_destination(const char *dest_file) {
+    struct stat dest_stat;
+    if (lstat(dest_file, &dest_stat) == -1 || !S_ISREG(dest_stat.st_mode) ||
+        dest_stat.st_nlink < 2) {
+        return 0;
+    }
+    if (unlink(dest_file) == -1) {
+        message_begin();
+        message_text("Error: Cannot unlink '");
+        message_text(dest_file);
+        message_text("' from the previous generation\n");
+        message_send(STDERR_FILENO);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Wait until the staging area has room for this copy (--stage-dir)
+ *
+ * This is the backpressure: producers block here while the staging
+ * filesystem is full, and continue as soon as background drains have
+ * freed enough space.
+ *
+ * Returns 0 when there is room, -1 if there never will be (or we
+ * waited STAGE_WAIT_SECONDS).
+ */
+int wait_for_stage_space(const char *stage_dir, int source_fd) {
+    struct stat st;
+    struct statvfs fs;
+    int told_user = 0;
+
+    if (fstat(source_fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        return 0;  // Unknown size - just try
+    }
+    unsigned long long needed = (unsigned long long)st.st_size;
+
+    for (int waited = 0; ; waited++) {
+        if (statvfs(stage_dir, &fs) == -1) {
+            return 0;  // Let the copy report the real error
+        }
+        unsigned long long fragment = fs.f_frsize ? fs.f_frsize : 512;
+        unsigned long long total = (unsigned long long)fs.f_blocks * fragment;
+        unsigned long long free_bytes = (unsigned long long)fs.f_bavail * fragment;
+        unsigned long long reserve = total / 100 * STAGE_RESERVE_PERCENT;
+
+        if (needed + reserve > total) {
+            error_message("Error: File is too large for the staging area\n");
+            return -1;
+        }
+        if (needed + reserve <= free_bytes) {
+            return 0;
+        }
+        if (waited >= STAGE_WAIT_SECONDS) {
+            error_message("Error: Staging area is still full - giving up\n");
+            return -1;
+        }
+        if (!told_user) {
+            message_begin();
+            message_text("Staging area is full - waiting for background drains...\n");
+            message_send(STDOUT_FILENO);
+            told_user = 1;
+        }
+        struct timespec second = {1, 0};
+        flush_output();
+        nanosleep(&second, 0);
+    }
+}
+
+/*
+ * Move a staged file to its final destination (runs in the background)
+ *
+ * Copies the staged file to a temporary name next to the destination,
+ * at no more than rate_kb KB/s if a rate was given, flushes it to disk,
+ * then rename()s it over the destination. Readers of the destination
+ * see either the old file or the complete new one - never a partial
+ * copy. Finally the staged file is removed to free the staging area.
+ *
+ * Returns 0 on success, 1 on error (the staged file is kept).
+ */
+int drain_staged(const char *stage_path, const char *dest_file, unsigned long long rate_kb) {
+    char part_path[PATH_LENGTH];
+    int pos = append_string(part_path, 0, dest_file);
+    pos = append_string(part_path, pos, ".my_copy-");
+    if (append_number(part_path, pos, (unsigned long long)getpid()) == -1) {
+        error_message("Error: Destination path is too long\n");
+        return 1;
+    }
+
+    int stage_fd = open(stage_path, O_RDONLY);
+    if (stage_fd == -1) {
+        message_begin();
+        message_text("Error: Cannot open staged file '");
+        message_text(stage_path);
+        message_text("'\n");
+        message_send(STDERR_FILENO);
+        return 1;
+    }
+    int part_fd = open(part_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (part_fd == -1) {
+        message_begin();
+        message_text("Error: Cannot create '");
+        message_text(part_path);
+        message_text("'\n");
+        message_send(STDERR_FILENO);
+        close(stage_fd);
+        return 1;
+    }
+    posix_fadvise(stage_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    unsigned long long drained = 0;
+    ssize_t bytes_read;
+    int failed = 0;
+
+    while ((bytes_read = read(stage_fd, buffer, MAX_BUFFER_SIZE)) > 0) {
+        if (write(part_fd, buffer, bytes_read) != bytes_read) {
+            failed = 1;
+            break;
+        }
+        drained += bytes_read;
+
+        /*
+         * Throttle: if we are ahead of rate_kb, sleep until we are not
+         */
+        if (rate_kb > 0) {
+            unsigned long long due_ns = drained / 1024 * 1000000000ULL / rate_kb;
+            unsigned long long spent_ns = elapsed_ns(&start);
+            if (due_ns > spent_ns) {
+                struct timespec pause;
+                pause.tv_sec = (time_t)((due_ns - spent_ns) / 1000000000ULL);
+                pause.tv_nsec = (long)((due_ns - spent_ns) % 1000000000ULL);
+                flush_output();
+                nanosleep(&pause, 0);
+            }
+        }
+    }
+
+    if (bytes_read == -1 || failed || fdatasync(part_fd) == -1 ||
+        close(part_fd) == -1 || rename(part_path, dest_file) == -1) {
+        message_begin();
+        message_text("Error: Background drain to '");
+        message_text(dest_file);
+        message_text("' failed - staged copy kept in '");
+        message_text(stage_path);
+        message_text("'\n");
+        message_send(STDERR_FILENO);
+        close(stage_fd);
+        unlink(part_path);
+        return 1;
+    }
+
+    close(stage_fd);
+    unlink(stage_path);
+    return 0;
+}
+
+/*
+ * Start the background drain (--stage-dir)
+ *
+ * fork()s a child that runs drain_staged() and returns at once in the
+ * parent, so the caller can report completion while the slow copy to
+ * the final destination continues. setsid() detaches the child from
+ * the terminal so closing it does not kill the drain.
+ *
+ * The child must not keep the caller's stdout/stderr: a caller reading
+ * our output through a pipe ("out=$(my_copy ...)") would wait until the
+ * drain is done, and nobody would see the drain's errors anyway. So
+ * stdin and stdout go to /dev/null, and stderr is appended to
+ * DRAIN_LOG in the staging directory.
+ *
+ * Returns 0 if the drain was started, -1 if fork() failed.
+ */
+int start_drain(const char *stage_path, const char *dest_file, unsigned long long rate_kb) {
+    flush_output();  // Or the child would print our batched lines again
+    pid_t pid = fork();
+    if (pid == -1) {
+        return -1;
+    }
+    if (pid == 0) {
+        setsid();
+        char log_path[PATH_LENGTH];
+        int null_fd = open("/dev/null", O_RDWR);
+        int log_fd = -1;
+        if (parent_directory(stage_path, log_path) == 0) {
+            int pos = append_string(log_path, string_length(log_path), "/" DRAIN_LOG);
+            if (pos != -1) {
+                log_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+            }
+        }
+        dup2(null_fd, STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(log_fd != -1 ? log_fd : null_fd, STDERR_FILENO);
+        if (null_fd > STDERR_FILENO) {
+            close(null_fd);
+        }
+        if (log_fd > STDERR_FILENO) {
+            close(log_fd);
+        }
+        _exit(drain_staged(stage_path, dest_file, rate_kb));
+    }
+    return 0;
+}
+
+/*
+ * Simulated slow device (--simulate-device)
+ *
+ * Lets us benchmark HDD-style behaviour on any machine. Every request
+ * that goes through dev_read()/dev_pread()/dev_write()/dev_pwrite() is
+ * charged, on top of the real system call:
+ *     latency + seek cost * distance moved + bytes / bandwidth
+ * The head position is remembered per device, so sequential requests pay
+ * no seek cost and scattered ones do. We nanosleep() for the charge (so
+ * anything that measures time reacts to it) and also add it up: the
+ * total is printed at the end and is exactly reproducible, unlike the
+ * wall-clock time.
+ *
+ * The source (and every --replica) and the destination are separate
+ * devices built from the same model. my_copy keeps one request in flight
+ * at a time, so there is no queue depth to model.
+ */
+struct device_model {
+    int enabled;
+    unsigned long long latency_ns;      // Fixed cost per request
+    unsigned long long seek_ns_per_gb;  // Cost per GB of head movement
+    unsigned long long bytes_per_sec;   // Bandwidth cap
+    unsigned long long head;            // Offset after the last request
+    unsigned long long total_ns;        // Simulated time charged so far
+    unsigned long long bad_offset;      // Reads touching this area fail...
+    unsigned long long bad_length;      // ...(0 = no bad area)
+};
+
+static struct device_model sim_source[MAX_REPLICAS];
+static struct device_model sim_dest;
+
+/*
+ * Helper function: Parse "LATENCY_US,SEEK_US_PER_GB,MB_PER_SEC"
+ *
+ * An optional fourth field ",BAD_OFFSET+BAD_LENGTH" (in bytes) makes
+ * every read from the source (not the replicas) that touches that area
+ * fail, like failing sectors do - to try out --rescue or --replica
+ * failover without a broken disk.
+ *
+ * Returns 0 on success, -1 if the text is not valid.
+ */
+int parse_device_model(const char *text, struct device_model *model) {
+    unsigned long long values[3];
+    int pos = 0;
+    for (int i = 0; i < 3; i++) {
+        if (parse_number(text, &pos, &values[i]) == -1) {
+            return -1;
+        }
+        if (i < 2 && text[pos++] != ',') {
+            return -1;
+        }
+    }
+    model->bad_offset = 0;
+    model->bad_length = 0;
+    if (text[pos] == ',') {
+        pos++;
+        if (parse_number(text, &pos, &model->bad_offset) == -1 || text[pos++] != '+' ||
+            parse_number(text, &pos, &model->bad_length) == -1) {
+            return -1;
+        }
+    }
+    if (text[pos] != '\0' || values[2] == 0) {
+        return -1;
+    }
+    model->enabled = 1;
+    model->latency_ns = values[0] * 1000;
+    model->seek_ns_per_gb = values[1] * 1000;
+    model->bytes_per_sec = values[2] * 1024 * 1024;
+    model->head = 0;
+    model->total_ns = 0;
+    return 0;
+}
+
+/*
+ * Helper function: Charge one request of length bytes at offset
+ */
+void charge_device(struct device_model *model, unsigned long long offset, unsigned long long length) {
+    unsigned long long distance = (offset > model->head) ? offset - model->head : model->head - offset;
+    unsigned long long cost = model->latency_ns
+                            + distance / 1024 * model->seek_ns_per_gb / (1024 * 1024)
+                            + length * 1000000000ULL / model->bytes_per_sec;
+    model->head = offset + length;
+    model->total_ns += cost;
+
+    flush_output();
+    struct timespec pause;
+    pause.tv_sec = (time_t)(cost / 1000000000ULL);
+    pause.tv_nsec = (long)(cost % 1000000000ULL);
+    nanosleep(&pause, 0);
+}
+
+/*
+ * Helper function: Does a read of size bytes at offset touch the bad area?
+ */
+int hits_bad_area(const struct device_model *model, unsigned long long offset, size_t size) {
+    return model->enabled && model->bad_length > 0 &&
+           offset < model->bad_offset + model->bad_length && offset + size > model->bad_offset;
+}
+
+ssize_t dev_pread(struct device_model *model, int fd, void *buf, size_t size, off_t offset) {
+    if (hits_bad_area(model, (unsigned long long)offset, size)) {
+        charge_device(model, (unsigned long long)offset, 0);
+        return -1;
+    }
+    ssize_t result = pread(fd, buf, size, offset);
+    if (model->enabled && result > 0) {
+        charge_device(model, (unsigned long long)offset, (unsigned long long)result);
+    }
+    return result;
+}
+
+ssize_t dev_pwrite(struct device_model *model, int fd, const void *buf, size_t size, off_t offset) {
+    ssize_t result = pwrite(fd, buf, size, offset);
+    if (model->enabled && result > 0) {
+        charge_device(model, (unsigned long long)offset, (unsigned long long)result);
+    }
+    return result;
+}
+
+ssize_t dev_read(struct device_model *model, int fd, void *buf, size_t size) {
+    off_t offset = model->enabled ? lseek(fd, 0, SEEK_CUR) : 0;
+    if (offset >= 0 && hits_bad_area(model, (unsigned long long)offset, size)) {
+        charge_device(model, (unsigned long long)offset, 0);
+        return -1;
+    }
+    ssize_t result = read(fd, buf, size);
+    if (model->enabled && result > 0 && offset >= 0) {
+        charge_device(model, (unsigned long long)offset, (unsigned long long)result);
+    }
+    return result;
+}
+
+ssize_t dev_write(struct device_model *model, int fd, const void *buf, size_t size) {
+    off_t offset = model->enabled ? lseek(fd, 0, SEEK_CUR) : 0;
+    ssize_t result = write(fd, buf, size);
+    if (model->enabled && result > 0 && offset >= 0) {
+        charge_device(model, (unsigned long long)offset, (unsigned long long)result);
+    }
+    return result;
+}
+
+/*
+ * Print the simulated device time (--simulate-device)
+ */
+void print_device_report(int replica_count) {
+    unsigned long long source_ns = 0;
+    unsigned long long busiest_ns = 0;
+    for (int r = 0; r <= replica_count; r++) {
+        source_ns += sim_source[r].total_ns;
+        if (sim_source[r].total_ns > busiest_ns) {
+            busiest_ns = sim_source[r].total_ns;
+        }
+    }
+    message_begin();
+    message_text("Simulated device time: source ");
+    message_number(source_ns / 1000000);
+    if (replica_count > 0) {
+        // The copies are separate devices: they could all work at once
+        message_text(" ms (busiest of ");
+        message_number((unsigned long long)replica_count + 1);
+        message_text(" copies ");
+        message_number(busiest_ns / 1000000);
+        message_text(" ms)");
+    }
+    else {
+        message_text(" ms");
+    }
+    message_text(", destination ");
+    message_number(sim_dest.total_ns / 1000000);
+    message_text(" ms\n");
+    message_send(STDOUT_FILENO);
+}
+
+/*
+ * One sample of the system-wide page cache counters (all in KB)
+ */
+struct cache_sample {
+    long long dirty;      // Modified pages not yet written back
+    long long writeback;  // Pages being written to disk right now
+    long long cached;     // File data held in the page cache
+};
+
+/*
+ * Helper function: Read Dirty, Writeback and Cached from /proc/meminfo
+ *
+ * Returns 0 on success, -1 if /proc/meminfo cannot be read.
+ */
+int sample_meminfo(struct cache_sample *sample) {
+    char text[MEMINFO_SIZE];
+    int fd = open("/proc/meminfo", O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    int total = 0;
+    ssize_t n;
+    while (total < MEMINFO_SIZE - 1 &&
+           (n = read(fd, text + total, MEMINFO_SIZE - 1 - total)) > 0) {
+        total += n;
+    }
+    close(fd);
+    text[total] = '\0';
+
+    sample->dirty = 0;
+    sample->writeback = 0;
+    sample->cached = 0;
+
+    int pos = 0;
+    while (text[pos] != '\0') {
+        long long *field = 0;
+        const char *rest;
+        if ((rest = skip_prefix(text + pos, "Dirty:")) != 0) {
+            field = &sample->dirty;
+        }
+        else if ((rest = skip_prefix(text + pos, "Writeback:")) != 0) {
+            field = &sample->writeback;
+        }
+        else if ((rest = skip_prefix(text + pos, "Cached:")) != 0) {
+            field = &sample->cached;
+        }
+
+        if (field != 0) {
+            pos = (int)(rest - text);
+            while (text[pos] == ' ') {
+                pos++;
+            }
+            unsigned long long value;
+            if (parse_number(text, &pos, &value) == 0) {
+                *field = (long long)value;
+            }
+        }
+
+        // Skip to the next line
+        while (text[pos] != '\0' && text[pos] != '\n') {
+            pos++;
+        }
+        if (text[pos] == '\n') {
+            pos++;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Helper function: How much of an open file is in the page cache?
+ *
+ * Maps the file a window at a time and asks mincore() which pages are
+ * resident. Mapping does not read anything - mincore() only looks.
+ *
+ * Stores the file size in *size (both in KB) and returns the resident
+ * amount, or -1 if the file cannot be checked.
+ */
+long long resident_kb_fd(int fd, long long *size) {
+    static unsigned char pages[CACHE_WINDOW / 512];  // 1 byte per page
+    long page_size = sysconf(_SC_PAGESIZE);
+    struct stat st;
+
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || page_size <= 0) {
+        return -1;
+    }
+
+    unsigned long long resident_pages = 0;
+    for (unsigned long long offset = 0; offset < (unsigned long long)st.st_size;
+         offset += CACHE_WINDOW) {
+        unsigned long long length = (unsigned long long)st.st_size - offset;
+        if (length > CACHE_WINDOW) {
+            length = CACHE_WINDOW;
+        }
+        void *map = mmap(0, length, PROT_READ, MAP_SHARED, fd, (off_t)offset);
+        if (map == MAP_FAILED) {
+            return -1;
+        }
+        unsigned long long count = (length + page_size - 1) / page_size;
+        if (mincore(map, length, pages) == 0) {
+            for (unsigned long long i = 0; i < count; i++) {
+                resident_pages += pages[i] & 1;
+            }
+        }
+        munmap(map, length);
+    }
+
+    *size = (long long)st.st_size / 1024;
+    return (long long)(resident_pages * (unsigned long long)page_size / 1024);
+}
+
+/*
+ * Helper function: How much of a file is in the page cache? (by path)
+ */
+long long resident_kb(const char *path, long long *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    long long resident = resident_kb_fd(fd, size);
+    close(fd);
+    return resident;
+}
+
+/*
+ * How the copy loop gets data from the source
+ */
+enum copy_strategy {
+    STRATEGY_BUFFERED,  // read() into our buffer (default)
+    STRATEGY_MAPPED,    // Source already cached: write() straight from mmap()
+    STRATEGY_DIRECT,    // Source cold and big: O_DIRECT reads bypass the cache
+    STRATEGY_REPLICAS   // --replica: stripes read round-robin from identical copies
+};
+
+struct copy_source {
+    int fd;
+    enum copy_strategy strategy;
+    const char *map;            // STRATEGY_MAPPED only
+    unsigned long long size;    // STRATEGY_MAPPED and STRATEGY_REPLICAS
+    unsigned long long offset;  // STRATEGY_MAPPED and STRATEGY_REPLICAS
+
+    // STRATEGY_REPLICAS only - replica 0 is the source itself
+    int replica_count;
+    int replica_fds[MAX_REPLICAS];
+    const char *replica_names[MAX_REPLICAS];
+    int replica_usable[MAX_REPLICAS];              // 0 once failed or too slow
+    unsigned long long replica_ns[MAX_REPLICAS];   // Time spent reading...
+    unsigned long long replica_bytes[MAX_REPLICAS];  // ...and bytes read
+};
+
+/*
+ * Pick the copy strategy from how much of the source is cached
+ *
+ * - Fully cached (>= CACHED_PERCENT): map the source and write() from the
+ *   mapping. The data goes page cache -> destination with no read() and
+ *   no copy into our buffer - as fast as a memory copy gets.
+ * - Cold (< COLD_PERCENT) and at least DIRECT_MIN_BYTES: switch the source
+ *   to O_DIRECT so reading it does not push everyone else's data out of
+ *   the cache, and drop the destination's clean pages when we are done.
+ * - Anything else: normal read() with POSIX_FADV_SEQUENTIAL so the kernel
+ *   reads ahead aggressively.
+ *
+ * If a strategy cannot be set up (e.g. tmpfs has no O_DIRECT) we quietly
+ * use the normal read() loop - it always works.
+ *
+ * The mapping is only used when reads_data is 0, i.e. nothing but the
+ * kernel's write() touches it. If the live source is truncated under us,
+ * write() then fails with EFAULT, where our own reads of the mapping
+ * (--sha256, --parity) would die with SIGBUS.
+ */
+void choose_strategy(struct copy_source *source, int reads_data) {
+    long long size_kb = 0;
+    long long cached_kb = resident_kb_fd(source->fd, &size_kb);
+    struct stat st;
+
+    source->strategy = STRATEGY_BUFFERED;
+    if (cached_kb < 0 || size_kb == 0 || fstat(source->fd, &st) == -1) {
+        return;
+    }
+    long long percent = cached_kb * 100 / size_kb;
+
+    if (percent >= CACHED_PERCENT && !reads_data) {
+        void *map = mmap(0, (size_t)st.st_size, PROT_READ, MAP_SHARED, source->fd, 0);
+        if (map != MAP_FAILED) {
+            source->strategy = STRATEGY_MAPPED;
+            source->map = map;
+            source->size = (unsigned long long)st.st_size;
+            source->offset = 0;
+            return;
+        }
+    }
+    else if (percent < COLD_PERCENT && (unsigned long long)st.st_size >= DIRECT_MIN_BYTES) {
+        int flags = fcntl(source->fd, F_GETFL);
+        if (flags != -1 && fcntl(source->fd, F_SETFL, flags | O_DIRECT) == 0) {
+            source->strategy = STRATEGY_DIRECT;
+            posix_fadvise(source->fd, 0, 0, POSIX_FADV_NOREUSE);
+            return;
+        }
+    }
+    posix_fadvise(source->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+/*
+ * Set up striped reading from several identical replicas (--replica)
+ *
+ * Every replica must have the same size and modification time as the
+ * source, otherwise mixing their stripes could produce a file that
+ * matches none of them. original is the source's stat taken before any
+ * --snapshot: the clone in source->fd has a fresh mtime.
+ *
+ * Returns 0 on success, -1 on error (replicas already opened are closed).
+ */
+int open_replicas(struct copy_source *source, const char *source_file,
+                  const struct stat *original, char *replicas[], int count) {
+    struct stat source_stat;
+    if (fstat(source->fd, &source_stat) == -1 || !S_ISREG(source_stat.st_mode)) {
+        error_message("Error: --replica needs a regular source file\n");
+        return -1;
+    }
+
+    source->strategy = STRATEGY_REPLICAS;
+    source->size = (unsigned long long)source_stat.st_size;
+    source->offset = 0;
+    source->replica_count = count + 1;
+    source->replica_fds[0] = source->fd;
+    source->replica_names[0] = source_file;
+
+    for (int r = 0; r <= count; r++) {
+        struct stat st;
+        int same = 1;  // The source itself (or its --snapshot clone)
+        if (r > 0) {
+            source->replica_names[r] = replicas[r - 1];
+            source->replica_fds[r] = open(replicas[r - 1], O_RDONLY);
+            same = source->replica_fds[r] != -1 && fstat(source->replica_fds[r], &st) == 0 &&
+                   st.st_size == source_stat.st_size &&
+                   st.st_mtim.tv_sec == original->st_mtim.tv_sec &&
+                   st.st_mtim.tv_nsec == original->st_mtim.tv_nsec;
+        }
+        if (!same) {
+            message_begin();
+            message_text("Error: Replica '");
+            message_text(source->replica_names[r]);
+            message_text("' cannot be opened or differs from the source "
+                         "(size or modification time)\n");
+            message_send(STDERR_FILENO);
+            for (int i = 1; i <= r; i++) {
+                if (source->replica_fds[i] != -1) {
+                    close(source->replica_fds[i]);
+                }
+            }
+            return -1;
+        }
+        source->replica_usable[r] = 1;
+        source->replica_ns[r] = 0;
+        source->replica_bytes[r] = 0;
+        posix_fadvise(source->replica_fds[r], 0, 0, POSIX_FADV_RANDOM);  // We do our own readahead
+    }
+    return 0;
+}
+
+/*
+ * Helper function: Close the extra replica descriptors
+ */
+void close_replicas(struct copy_source *source) {
+    for (int r = 1; r < source->replica_count; r++) {
+        close(source->replica_fds[r]);
+    }
+}
+
+/*
+ * Helper function: Which replica serves a stripe?
+ *
+ * Stripe i belongs to replica i % count; if that one is no longer usable
+ * the next usable one takes over. Returns -1 if none is left.
+ */
+int replica_for_stripe(const struct copy_source *source, unsigned long long stripe) {
+    for (int tries = 0; tries < source->replica_count; tries++) {
+        int r = (int)((stripe + tries) % source->replica_count);
+        if (source->replica_usable[r]) {
+            return r;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Read one stripe from the replicas
+ *
+ * We are single-threaded, so the parallelism comes from the kernel:
+ * before reading stripe i we ask (POSIX_FADV_WILLNEED) for the stripes
+ * REPLICA_READAHEAD rounds ahead, each from the replica that will serve
+ * it. The kernel reads those in the background on every device at once
+ * while we copy, so bandwidth adds up across the replicas.
+ *
+ * A replica whose read fails is dropped and its stripes go to the
+ * others; so is one that turns out REPLICA_SLOW_FACTOR times slower than
+ * the fastest. The copy only fails if every replica fails.
+ */
+ssize_t read_replica_stripe(struct copy_source *source, size_t size) {
+    if (source->offset >= source->size) {
+        return 0;
+    }
+    unsigned long long stripe = source->offset / size;
+    unsigned long long ahead = stripe + (unsigned long long)REPLICA_READAHEAD * source->replica_count;
+    if (stripe == 0) {
+        // First call: start every stripe up to the readahead window
+        for (unsigned long long i = 1; i < ahead; i++) {
+            int r = replica_for_stripe(source, i);
+            if (r != -1) {
+                posix_fadvise(source->replica_fds[r], (off_t)(i * size), (off_t)size,
+                              POSIX_FADV_WILLNEED);
+            }
+        }
+    }
+    int next = replica_for_stripe(source, ahead);
+    if (next != -1) {
+        posix_fadvise(source->replica_fds[next], (off_t)(ahead * size), (off_t)size,
+                      POSIX_FADV_WILLNEED);
+    }
+
+    size_t wanted = size;
+    if (source->size - source->offset < wanted) {
+        wanted = (size_t)(source->size - source->offset);
+    }
+
+    int r;
+    while ((r = replica_for_stripe(source, stripe)) != -1) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        ssize_t got = dev_pread(&sim_source[r], source->replica_fds[r], buffer, wanted,
+                                (off_t)source->offset);
+
+        if (got == (ssize_t)wanted) {
+            source->replica_ns[r] += elapsed_ns(&start);
+            source->replica_bytes[r] += (unsigned long long)got;
+            source->offset += (unsigned long long)got;
+
+            /*
+             * Slow check: compare nanoseconds per MB against the fastest
+             * replica that has been sampled enough
+             */
+            if (source->replica_bytes[r] >= REPLICA_MIN_SAMPLES) {
+                unsigned long long mine = source->replica_ns[r] / (source->replica_bytes[r] >> 20);
+                for (int o = 0; o < source->replica_count; o++) {
+                    if (o == r || !source->replica_usable[o] ||
+                        source->replica_bytes[o] < REPLICA_MIN_SAMPLES) {
+                        continue;
+                    }
+                    unsigned long long theirs = source->replica_ns[o] / (source->replica_bytes[o] >> 20);
+                    if (mine > theirs * REPLICA_SLOW_FACTOR) {
+                        message_begin();
+                        message_text("Warning: Replica '");
+                        message_text(source->replica_names[r]);
+                        message_text("' is slow - using the others\n");
+                        message_send(STDERR_FILENO);
+                        source->replica_usable[r] = 0;
+                        break;
+                    }
+                }
+            }
+            return got;
+        }
+
+        // Failed or short read: this replica is out
+        message_begin();
+        message_text("Warning: Reading replica '");
+        message_text(source->replica_names[r]);
+        message_text("' failed - using the others\n");
+        message_send(STDERR_FILENO);
+        source->replica_usable[r] = 0;
+    }
+    return -1;
+}
+
+/*
+ * Helper function: Leave STRATEGY_MAPPED and go on with read() at offset
+ *
+ * For a source that shrinks under us (e.g. logrotate's copytruncate):
+ * read() simply stops at the new end, like a plain copy would.
+ */
+void stop_mapping(struct copy_source *source, unsigned long long offset) {
+    munmap((void *)source->map, (size_t)source->size);
+    source->strategy = STRATEGY_BUFFERED;
+    lseek(source->fd, (off_t)offset, SEEK_SET);
+}
+
+/*
+ * Get the next chunk of source data
+ *
+ * Sets *data to where the chunk is (our buffer, or the mapping) and
+ * returns its length like read(): 0 at end of file, -1 on error.
+ *
+ * A mapped source is checked with fstat() before every chunk, so pages
+ * past a new, shorter end are never handed to write().
+ */
+ssize_t read_chunk(struct copy_source *source, const char **data, size_t size) {
+    struct stat st;
+    if (source->strategy == STRATEGY_MAPPED &&
+        (fstat(source->fd, &st) == -1 || (unsigned long long)st.st_size < source->size)) {
+        stop_mapping(source, source->offset);
+    }
+    if (source->strategy == STRATEGY_MAPPED) {
+        unsigned long long left = source->size - source->offset;
+        if (left < size) {
+            size = (size_t)left;
+        }
+        *data = source->map + source->offset;
+        source->offset += size;
+        return (ssize_t)size;
+    }
+    if (source->strategy == STRATEGY_REPLICAS) {
+        *data = buffer;
+        return read_replica_stripe(source, size);
+    }
+    *data = buffer;
+    return dev_read(&sim_source[0], source->fd, buffer, size);
+}
+
+/*
+ * Keep a cold copy from filling the cache with destination pages
+ *
+ * Called after every write while STRATEGY_DIRECT is in use. Each time
+ * another DROP_WINDOW bytes are written we start writeback of them, wait
+ * for the window before that to reach the disk, and drop its (now clean)
+ * pages. The page cache holds at most about two windows of our data.
+ */
+void drop_written_pages(int dest_fd, unsigned long long written,
+                        unsigned long long *started, unsigned long long *dropped) {
+    if (written - *started < DROP_WINDOW) {
+        return;
+    }
+    sync_file_range(dest_fd, (off_t)*started, (off_t)(written - *started),
+                    SYNC_FILE_RANGE_WRITE);
+    if (*started > *dropped) {
+        sync_file_range(dest_fd, (off_t)*dropped, (off_t)(*started - *dropped),
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                        SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(dest_fd, (off_t)*dropped, (off_t)(*started - *dropped),
+                      POSIX_FADV_DONTNEED);
+    }
+    *dropped = *started;
+    *started = written;
+}
+
+/*
+ * Helper function: Write one "<label><value> KB" report line
+ */
+void report_kb(const char *label, long long value) {
+    message_begin();
+    message_text(label);
+    if (value < 0) {
+        message_text("-");
+        value = -value;
+    }
+    message_number((unsigned long long)value);
+    message_text(" KB\n");
+    message_send(STDOUT_FILENO);
+}
+
+/*
+ * Print the page-cache impact of the copy (--cache-report)
+ *
+ * - Net cache growth: change in Cached between before and after
+ * - Peak dirty / writeback: highest values seen while copying, minus
+ *   the values before it started. /proc/meminfo is system-wide, so this
+ *   is still only an estimate on a busy host.
+ * - Evicted: if our two files gained more cache than the system did,
+ *   the difference must have been pushed out of the cache (other data,
+ *   or the start of our own files)
+ */
+void print_cache_report(const struct cache_sample *before,
+                        const struct cache_sample *after,
+                        const struct cache_sample *peak,
+                        long long source_before, const char *source_file,
+                        const char *dest_file) {
+    long long source_size = 0;
+    long long dest_size = 0;
+    long long source_after = resident_kb(source_file, &source_size);
+    long long dest_after = resident_kb(dest_file, &dest_size);
+
+    message_begin();
+    message_text("Cache report:\n");
+    message_send(STDOUT_FILENO);
+    if (source_before >= 0 && source_after >= 0) {
+        report_kb("  Source cached before:      ", source_before);
+        report_kb("  Source cached after:       ", source_after);
+    }
+    if (dest_after >= 0) {
+        report_kb("  Destination cached after:  ", dest_after);
+    }
+    report_kb("  Net page cache growth:     ", after->cached - before->cached);
+    report_kb("  Peak dirty added:          ", peak->dirty - before->dirty);
+    report_kb("  Peak writeback added:      ", peak->writeback - before->writeback);
+
+    if (source_before >= 0 && source_after >= 0 && dest_after >= 0) {
+        long long ours = (source_after - source_before) + dest_after;
+        long long evicted = ours - (after->cached - before->cached);
+        report_kb("  Evicted from cache (est.): ", evicted > 0 ? evicted : 0);
+    }
+}
+
+/*
+ * Preflight check: will the copy fit on the destination?
+ *
+ * Compares what the copy needs with statvfs() of the destination
+ * directory BEFORE the destination is truncated, so a copy that would
+ * die halfway with ENOSPC is refused before any data moves.
+ *
+ * - Space: the source size rounded up to whole fragments. Our read/write
+ *   loop writes holes out as zeros, so we need st_size, not st_blocks.
+ *   An existing destination gives its blocks back when truncated. With
+ *   truncates unset (--shard, a resumed --rescue) it is written in place
+ *   instead: the blocks it already has are data that needs no new space.
+ * - Inodes: one, unless the destination already exists.
+ *
+ * A destination that exists but is not a regular file (a disk, /dev/null,
+ * a FIFO) is not stored in its parent directory's filesystem, so there
+ * is nothing to check.
+ *
+ * If the destination device was calibrated, also prints how long the
+ * copy should take (only when it is at least a second).
+ *
+ * Returns 0 if the copy fits (or the check cannot be made), -1 if not.
+ */
+int preflight_check(int source_fd, const char *dest_file, int truncates, const char *profiles) {
+    struct stat source_stat;
+    struct stat dest_stat;
+    struct stat dir_stat;
+    struct statvfs fs;
+    char dir[PATH_LENGTH];
+
+    int dest_exists = stat(dest_file, &dest_stat) == 0;
+    if (dest_exists && !S_ISREG(dest_stat.st_mode)) {
+        return 0;
+    }
+    if (fstat(source_fd, &source_stat) == -1 || !S_ISREG(source_stat.st_mode) ||
+        parent_directory(dest_file, dir) == -1 || statvfs(dir, &fs) == -1) {
+        return 0;  // Nothing we can predict - let the copy report any error
+    }
+
+    unsigned long long fragment = fs.f_frsize ? fs.f_frsize : 512;
+    unsigned long long needed = ((unsigned long long)source_stat.st_size + fragment - 1)
+                                / fragment * fragment;
+    unsigned long long available = (unsigned long long)fs.f_bavail * fragment;
+    unsigned long long inodes_needed = 1;
+
+    if (dest_exists) {
+        inodes_needed = 0;
+        unsigned long long allocated = (unsigned long long)dest_stat.st_blocks * 512;
+        if (truncates) {
+            available += allocated;
+        }
+        else {
+            needed -= allocated < needed ? allocated : needed;
+        }
+    }
+
+    if (needed > available) {
+        message_begin();
+        message_text("Error: Not enough space on destination (need ");
+        message_number(needed);
+        message_text(" bytes, ");
+        message_number(available);
+        message_text(" available)\n");
+        message_send(STDERR_FILENO);
+        return -1;
+    }
+
+    // Some filesystems (e.g. btrfs) report 0 inodes - they allocate on demand
+    if (inodes_needed > fs.f_favail && fs.f_files != 0) {
+        error_message("Error: No free inodes on destination\n");
+        return -1;
+    }
+
+    unsigned long long rate = 0;
+    if (stat(dir, &dir_stat) == 0) {
+        lookup_profile(profiles, (unsigned long long)dir_stat.st_dev, &rate);
+    }
+    if (rate > 0 && !quiet) {
+        unsigned long long seconds = (needed / 1024) / rate;
+        if (seconds >= 1) {
+            message_begin();
+            message_text("Estimated copy time: ");
+            message_number(seconds);
+            message_text(" s (calibrated ");
+            if (rate >= 1024) {
+                message_number(rate / 1024);
+                message_text(" MB/s)\n");
+            }
+            else {
+                message_number(rate);
+                message_text(" KB/s)\n");
+            }
+            message_send(STDOUT_FILENO);
+            flush_output();  // The copy takes a while - show the estimate now
+        }
+    }
+    return 0;
+}
+
+/*
+ * Calibrate the device holding the given directory
+ *
+ * Writes CALIBRATE_BYTES to a scratch file with each candidate request
+ * size (4 KB up to 1 MB), forcing the data to the device with fdatasync()
+ * so we time the disk and not the page cache. The fastest size and its
+ * rate are stored in the profile cache keyed by the device ID (st_dev),
+ * and later copies use them without any guessing. Run it again at any
+ * time to refresh.
+ *
+ * A larger size must be at least 5% faster to win, so noise does not
+ * push us towards needlessly large requests.
+ */
+int calibrate(const char *directory, const char *profile_path) {
+    char scratch_path[PATH_LENGTH];
+    int pos = append_string(scratch_path, 0, directory);
+    pos = append_string(scratch_path, pos, "/.my_copy_calibrate");
+    if (pos == -1) {
+        error_message("Error: Directory path is too long\n");
+        return 1;
+    }
+
+    int fd = open(scratch_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        message_begin();
+        message_text("Error: Cannot create scratch file in '");
+        message_text(directory);
+        message_text("'\n");
+        message_send(STDERR_FILENO);
+        return 1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        error_message("Error: Cannot stat scratch file\n");
+        close(fd);
+        unlink(scratch_path);
+        return 1;
+    }
+
+    // Fill the buffer with a non-zero pattern
+    for (int i = 0; i < MAX_BUFFER_SIZE; i++) {
+        buffer[i] = (char)(i * 31 + 7);
+    }
+
+    unsigned long long best_size = 0;
+    unsigned long long best_rate = 0;
+
+    for (unsigned long long size = BUFFER_SIZE; size <= MAX_BUFFER_SIZE; size *= 4) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        if (lseek(fd, 0, SEEK_SET) == -1) {
+            break;
+        }
+        unsigned long long done = 0;
+        while (done < CALIBRATE_BYTES) {
+            if (write(fd, buffer, size) != (ssize_t)size) {
+                error_message("Error: Failed to write scratch file\n");
+                close(fd);
+                unlink(scratch_path);
+                return 1;
+            }
+            done += size;
+        }
+        fdatasync(fd);
+
+        unsigned long long ns = elapsed_ns(&start);
+        if (ns == 0) {
+            ns = 1;
+        }
+        // Throughput in KB/s (integer math - no floating point needed)
+        unsigned long long rate = (CALIBRATE_BYTES / 1024) * 1000000000ULL / ns;
+
+        message_begin();
+        message_text("  ");
+        message_number(size);
+        message_text(" bytes: ");
+        message_number(rate / 1024);
+        message_text(" MB/s\n");
+        message_send(STDOUT_FILENO);
+        flush_output();  // Each size takes a while to measure
+
+        if (rate > best_rate + best_rate / 20) {
+            best_rate = rate;
+            best_size = size;
+        }
+    }
+
+    close(fd);
+    unlink(scratch_path);
+
+    if (best_size == 0) {
+        error_message("Error: Calibration failed\n");
+        return 1;
+    }
+
+    if (save_profile(profile_path, (unsigned long long)st.st_dev,
+                     best_size, best_rate) == -1) {
+        message_begin();
+        message_text("Error: Cannot write profile cache '");
+        message_text(profile_path);
+        message_text("'\n");
+        message_send(STDERR_FILENO);
+        return 1;
+    }
+
+    message_begin();
+    message_text("Device ");
+    message_number((unsigned long long)st.st_dev);
+    message_text(": using ");
+    message_number(best_size);
+    message_text("-byte requests (saved to '");
+    message_text(profile_path);
+    message_text("')\n");
+    message_send(STDOUT_FILENO);
+    return 0;
+}
+
+/*
+ * Helper function: Parse "I/N" for --shard (0 <= I < N)
+ *
+ * Returns 0 on success, -1 if the text is not a valid I/N.
+ */
+int parse_shard_spec(const char *text, unsigned long long *index, unsigned long long *count) {
+    int pos = 0;
+    if (parse_number(text, &pos, index) == -1 || text[pos++] != '/' ||
+        parse_number(text, &pos, count) == -1 || text[pos] != '\0') {
+        return -1;
+    }
+    return (*count >= 1 && *index < *count) ? 0 : -1;
+}
+
+/*
+ * Helper function: Build "<dest>.leases/<chunk>[suffix]"
+ */
+int lease_path(const char *dest_file, unsigned long long chunk, const char *suffix, char *path) {
+    int pos = append_string(path, 0, dest_file);
+    pos = append_string(path, pos, ".leases/");
+    pos = append_number(path, pos, chunk);
+    return append_string(path, pos, suffix) == -1 ? -1 : 0;
+}
+
+/*
+ * Helper function: Try to claim a chunk by creating its lease file
+ *
+ * O_CREAT | O_EXCL is atomic: if several shards race for the same
+ * chunk, exactly one create succeeds. Returns 1 if the chunk is ours.
+ */
+int claim_chunk(const char *dest_file, unsigned long long chunk) {
+    char path[PATH_LENGTH];
+    if (lease_path(dest_file, chunk, "", path) == -1) {
+        return 0;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd == -1) {
+        return 0;
+    }
+    write_number(fd, (unsigned long long)getpid());
+    close(fd);
+    return 1;
+}
+
+/*
+ * Helper function: Copy one chunk with pread()/pwrite()
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int copy_chunk(int source_fd, int dest_fd, unsigned long long chunk,
+               unsigned long long file_size, size_t buffer_size) {
+    unsigned long long offset = chunk * SHARD_CHUNK;
+    unsigned long long end = offset + SHARD_CHUNK;
+    if (end > file_size) {
+        end = file_size;
+    }
+    while (offset < end) {
+        size_t wanted = buffer_size;
+        if (end - offset < wanted) {
+            wanted = (size_t)(end - offset);
+        }
+        ssize_t got = dev_pread(&sim_source[0], source_fd, buffer, wanted, (off_t)offset);
+        if (got <= 0 ||
+            dev_pwrite(&sim_dest, dest_fd, buffer, (size_t)got, (off_t)offset) != got) {
+            return -1;
+        }
+        offset += (unsigned long long)got;
+    }
+    return 0;
+}
+
+/*
+ * Copy this process's share of the file (--shard I/N [--leases])
+ *
+ * The file is cut into SHARD_CHUNK pieces and chunk c belongs to shard
+ * c % N. That split is deterministic and balanced (shards differ by at
+ * most one chunk), so N processes - on one machine or on N hosts that
+ * share the storage - can each run "--shard I/N" with no coordinator.
+ * Every process sets the destination to the full size first, and the
+ * chunks are written in place, so the processes never overwrite each
+ * other's data.
+ *
+ * With --leases, every chunk must also be claimed with a lease file in
+ * "<dest>.leases/" before it is copied. A shard that finishes its own
+ * chunks then walks the other shards' chunks from the end (where their
+ * owners will get last) and steals any it can still claim. Finished
+ * chunks get a "<chunk>.done" file; whoever sees every chunk done
+ * removes the lease directory. If a shard dies, its claimed chunks stay
+ * unfinished: delete the lease directory and run again.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int copy_shards(int source_fd, int dest_fd, const char *dest_file,
+                unsigned long long index, unsigned long long count,
+                int use_leases, size_t buffer_size, unsigned long long *copied) {
+    struct stat st;
+    if (fstat(source_fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        error_message("Error: --shard needs a regular source file\n");
+        return -1;
+    }
+    unsigned long long file_size = (unsigned long long)st.st_size;
+    unsigned long long chunks = (file_size + SHARD_CHUNK - 1) / SHARD_CHUNK;
+
+    if (ftruncate(dest_fd, (off_t)file_size) == -1) {
+        error_message("Error: Cannot set destination size\n");
+        return -1;
+    }
+
+    char lease_dir[PATH_LENGTH];
+    if (use_leases) {
+        int pos = append_string(lease_dir, 0, dest_file);
+        if (append_string(lease_dir, pos, ".leases") == -1 ||
+            (mkdir(lease_dir, 0755) == -1 && access(lease_dir, F_OK) == -1)) {
+            error_message("Error: Cannot create lease directory\n");
+            return -1;
+        }
+    }
+
+    *copied = 0;
+    for (int pass = 0; pass < (use_leases ? 2 : 1); pass++) {
+        for (unsigned long long i = 0; i < chunks; i++) {
+            // Pass 0: our own chunks in order. Pass 1: steal from the end.
+            unsigned long long chunk = (pass == 0) ? i : chunks - 1 - i;
+            if ((pass == 0) != (chunk % count == index)) {
+                continue;
+            }
+            if (use_leases && !claim_chunk(dest_file, chunk)) {
+                continue;
+            }
+            if (copy_chunk(source_fd, dest_fd, chunk, file_size, buffer_size) == -1) {
+                message_begin();
+                message_text("Error: Failed to copy chunk ");
+                message_number(chunk);
+                message_text("\n");
+                message_send(STDERR_FILENO);
+                return -1;
+            }
+            (*copied)++;
+            if (use_leases) {
+                char path[PATH_LENGTH];
+                if (lease_path(dest_file, chunk, ".done", path) == 0) {
+                    int fd = open(path, O_WRONLY | O_CREAT, 0644);
+                    if (fd != -1) {
+                        close(fd);
+                    }
+                }
+            }
+        }
+    }
+
+    /*
+     * Last one out removes the lease directory
+     */
+    if (use_leases) {
+        char path[PATH_LENGTH];
+        for (unsigned long long c = 0; c < chunks; c++) {
+            if (lease_path(dest_file, c, ".done", path) == -1 || access(path, F_OK) == -1) {
+                return 0;  // Someone is still working
+            }
+        }
+        for (unsigned long long c = 0; c < chunks; c++) {
+            lease_path(dest_file, c, "", path);
+            unlink(path);
+            lease_path(dest_file, c, ".done", path);
+            unlink(path);
+        }
+        rmdir(lease_dir);
+    }
+    return 0;
+}
+
+/*
+ * ========================================================================
+ * Rescue copy from failing media (--rescue MAPFILE)
+ * ========================================================================
+ *
+ * A normal copy stops at the first read error. A rescue copy gets the
+ * easy data first and leaves the hard part for later:
+ *
+ *   Pass 1:  Read the whole source in large blocks. After a read error,
+ *            mark the area bad and jump ahead - further each time errors
+ *            follow each other - so a damaged zone costs a few failed
+ *            reads instead of thousands.
+ *   Retries: Read every bad area again in RESCUE_RETRY_BLOCK pieces. The
+ *            pieces that still fail are split in half for the next pass
+ *            (bisection), down to single 512-byte sectors. Whatever reads
+ *            is written and leaves the bad list.
+ *
+ * Good data is written at its own offset, so unreadable areas stay holes
+ * (zeros) in the destination.
+ *
+ * The map file records how far pass 1 got, the piece size of the current
+ * retry pass and the list of bad areas. It is rewritten atomically (a
+ * temporary file renamed over it) every RESCUE_SAVE_SECONDS and after
+ * every pass, so an interrupted rescue continues where it stopped when
+ * run again with the same map file. The format is plain text:
+ *     size <source size>
+ *     pos <bytes done by pass 1>
+ *     block <piece size of the retry pass>
+ *     bad <offset> <length>
+ *     ...
+ */
+struct rescue_region {
+    unsigned long long offset;
+    unsigned long long length;
+};
+
+/*
+ * Bad areas, sorted by offset. A retry pass reads one list and builds
+ * the other one, then they swap.
+ */
+static struct rescue_region rescue_lists[2][RESCUE_MAX_REGIONS];
+static char rescue_text[RESCUE_MAP_SIZE];
+
+struct rescue_state {
+    unsigned long long size;   // Source size
+    unsigned long long pos;    // Pass 1 is done up to here
+    unsigned long long block;  // Piece size of the retry pass in progress
+    struct rescue_region *bad; // Bad areas still to retry
+    int bad_count;
+    struct rescue_region *done;  // Areas this retry pass has already been over
+    int done_count;
+};
+
+/*
+ * Helper function: Add a bad area to the end of a list
+ *
+ * Touching areas are merged. When the list is full the last area is
+ * stretched to cover the new one - good data in between is read again
+ * by the next pass, nothing is lost.
+ */
+void add_bad_region(struct rescue_region *list, int *count,
+                    unsigned long long offset, unsigned long long length) {
+    if (*count > 0) {
+        struct rescue_region *last = &list[*count - 1];
+        if (last->offset + last->length == offset || *count == RESCUE_MAX_REGIONS) {
+            last->length = offset + length - last->offset;
+            return;
+        }
+    }
+    list[*count].offset = offset;
+    list[*count].length = length;
+    (*count)++;
+}
+
+/*
+ * Helper function: Total bytes in a list of bad areas
+ */
+unsigned long long bad_bytes(const struct rescue_region *list, int count) {
+    unsigned long long total = 0;
+    for (int i = 0; i < count; i++) {
+        total += list[i].length;
+    }
+    return total;
+}
+
+/*
+ * Helper function: Write the map file
+ *
+ * During a retry pass the areas it has been over (state->done) come
+ * first, then the ones it has not reached (state->bad from index next).
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int save_rescue_map(const char *path, const struct rescue_state *state, int next) {
+    char tmp_path[PATH_LENGTH];
+    int pos = append_string(tmp_path, 0, path);
+    if (append_string(tmp_path, pos, ".tmp") == -1) {
+        return -1;
+    }
+
+    pos = append_string(rescue_text, 0, "size ");
+    pos = append_number(rescue_text, pos, state->size);
+    pos = append_string(rescue_text, pos, "\npos ");
+    pos = append_number(rescue_text, pos, state->pos);
+    pos = append_string(rescue_text, pos, "\nblock ");
+    pos = append_number(rescue_text, pos, state->block);
+    pos = append_string(rescue_text, pos, "\n");
+    for (int list = 0; list < 2; list++) {
+        const struct rescue_region *regions = list == 0 ? state->done : state->bad;
+        int first = list == 0 ? 0 : next;
+        int count = list == 0 ? state->done_count : state->bad_count;
+        for (int i = first; i < count; i++) {
+            pos = append_string(rescue_text, pos, "bad ");
+            pos = append_number(rescue_text, pos, regions[i].offset);
+            pos = append_string(rescue_text, pos, " ");
+            pos = append_number(rescue_text, pos, regions[i].length);
+            pos = append_string(rescue_text, pos, "\n");
+        }
+    }
+    if (pos == -1) {
+        return -1;
+    }
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t written = write(fd, rescue_text, (size_t)pos);
+    if (close(fd) == -1 || written != pos || rename(tmp_path, path) == -1) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Helper function: Read the map file of an interrupted rescue
+ *
+ * Returns 0 on success, -1 if it cannot be read or is not a map for a
+ * source of this size.
+ */
+int load_rescue_map(const char *path, struct rescue_state *state) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    int total = 0;
+    ssize_t n;
+    while (total < RESCUE_MAP_SIZE - 1 &&
+           (n = read(fd, rescue_text + total, RESCUE_MAP_SIZE - 1 - total)) > 0) {
+        total += n;
+    }
+    close(fd);
+    rescue_text[total] = '\0';
+
+    unsigned long long size = 0;
+    int pos = 0;
+    while (rescue_text[pos] != '\0') {
+        const char *line = rescue_text + pos;
+        const char *rest;
+        int ok;
+        int at = 0;
+        unsigned long long length;
+        if ((rest = skip_prefix(line, "size ")) != 0) {
+            ok = parse_number(rest, &at, &size) == 0;
+        }
+        else if ((rest = skip_prefix(line, "pos ")) != 0) {
+            ok = parse_number(rest, &at, &state->pos) == 0;
+        }
+        else if ((rest = skip_prefix(line, "block ")) != 0) {
+            ok = parse_number(rest, &at, &state->block) == 0;
+        }
+        else if ((rest = skip_prefix(line, "bad ")) != 0) {
+            unsigned long long offset;
+            ok = parse_number(rest, &at, &offset) == 0 && rest[at++] == ' ' &&
+                 parse_number(rest, &at, &length) == 0;
+            if (ok) {
+                add_bad_region(state->bad, &state->bad_count, offset, length);
+            }
+        }
+        else {
+            ok = 0;
+        }
+        if (!ok || rest[at] != '\n') {
+            return -1;
+        }
+        pos += (int)(rest - line) + at + 1;
+    }
+    if (size != state->size || state->pos > size ||
+        state->block < RESCUE_MIN_BLOCK || state->block > RESCUE_RETRY_BLOCK) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Copy as much of a failing source as can be read (--rescue MAPFILE)
+ *
+ * With resume set, continue the rescue recorded in map_path; otherwise
+ * start a new one.
+ *
+ * Returns 0 if every byte was rescued, 1 if some areas are still
+ * unreadable, -1 on error.
+ */
+int rescue_copy(int source_fd, int dest_fd, const char *map_path, int resume) {
+    struct rescue_state state;
+    struct timespec last_save;
+    off_t end = lseek(source_fd, 0, SEEK_END);  // Also works for block devices
+
+    if (end == -1) {
+        error_message("Error: Cannot find the size of the source\n");
+        return -1;
+    }
+    state.size = (unsigned long long)end;
+    state.pos = 0;
+    state.block = RESCUE_RETRY_BLOCK;
+    state.bad = rescue_lists[0];
+    state.bad_count = 0;
+    state.done = rescue_lists[1];
+    state.done_count = 0;
+
+    if (resume && load_rescue_map(map_path, &state) == -1) {
+        message_begin();
+        message_text("Error: '");
+        message_text(map_path);
+        message_text("' is not a rescue map for this source\n");
+        message_send(STDERR_FILENO);
+        return -1;
+    }
+    if (ftruncate(dest_fd, end) == -1 || save_rescue_map(map_path, &state, 0) == -1) {
+        error_message("Error: Cannot prepare destination or map file\n");
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &last_save);
+
+    /*
+     * Pass 1: large blocks, skip quickly past errors
+     */
+    unsigned long long skip = MAX_BUFFER_SIZE;
+    while (state.pos < state.size) {
+        size_t wanted = MAX_BUFFER_SIZE;
+        if (state.size - state.pos < wanted) {
+            wanted = (size_t)(state.size - state.pos);
+        }
+        ssize_t got = dev_pread(&sim_source[0], source_fd, buffer, wanted, (off_t)state.pos);
+        if (got > 0) {
+            if (dev_pwrite(&sim_dest, dest_fd, buffer, (size_t)got, (off_t)state.pos) != got) {
+                error_message("Error: Failed to write to destination file\n");
+                return -1;
+            }
+            state.pos += (unsigned long long)got;
+            skip = MAX_BUFFER_SIZE;
+        }
+        else {
+            // Error (or the source got shorter): skip this area for now
+            unsigned long long length = skip;
+            if (state.size - state.pos < length) {
+                length = state.size - state.pos;
+            }
+            add_bad_region(state.bad, &state.bad_count, state.pos, length);
+            state.pos += length;
+            skip = (skip * 2 < RESCUE_MAX_SKIP) ? skip * 2 : RESCUE_MAX_SKIP;
+        }
+        if (elapsed_ns(&last_save) >= RESCUE_SAVE_SECONDS * 1000000000ULL) {
+            save_rescue_map(map_path, &state, 0);
+            clock_gettime(CLOCK_MONOTONIC, &last_save);
+        }
+    }
+    save_rescue_map(map_path, &state, 0);
+
+    if (!quiet && state.bad_count > 0) {
+        message_begin();
+        message_text("Rescue: ");
+        message_number(bad_bytes(state.bad, state.bad_count));
+        message_text(" bytes in ");
+        message_number((unsigned long long)state.bad_count);
+        message_text(" areas could not be read yet - retrying them\n");
+        message_send(STDOUT_FILENO);
+        flush_output();  // Retrying can take long - show it now
+    }
+
+    /*
+     * Retry passes: smaller and smaller pieces. Read-ahead would only
+     * run into the bad sectors again, so turn it off.
+     */
+    posix_fadvise(source_fd, 0, 0, POSIX_FADV_RANDOM);
+    while (state.bad_count > 0 && state.block >= RESCUE_MIN_BLOCK) {
+        for (int i = 0; i < state.bad_count; i++) {
+            unsigned long long offset = state.bad[i].offset;
+            unsigned long long region_end = offset + state.bad[i].length;
+            while (offset < region_end) {
+                size_t wanted = (size_t)state.block;
+                if (region_end - offset < wanted) {
+                    wanted = (size_t)(region_end - offset);
+                }
+                ssize_t got = dev_pread(&sim_source[0], source_fd, buffer, wanted, (off_t)offset);
+                if (got > 0) {
+                    if (dev_pwrite(&sim_dest, dest_fd, buffer, (size_t)got, (off_t)offset) != got) {
+                        error_message("Error: Failed to write to destination file\n");
+                        return -1;
+                    }
+                    offset += (unsigned long long)got;
+                }
+                else {
+                    add_bad_region(state.done, &state.done_count, offset, wanted);
+                    offset += wanted;
+                }
+            }
+            if (elapsed_ns(&last_save) >= RESCUE_SAVE_SECONDS * 1000000000ULL) {
+                save_rescue_map(map_path, &state, i + 1);
+                clock_gettime(CLOCK_MONOTONIC, &last_save);
+            }
+        }
+
+        // The areas that still failed are the input of the next pass
+        struct rescue_region *swap = state.bad;
+        state.bad = state.done;
+        state.bad_count = state.done_count;
+        state.done = swap;
+        state.done_count = 0;
+        state.block /= 2;
+        if (state.block < RESCUE_MIN_BLOCK) {
+            state.block = RESCUE_MIN_BLOCK;  // Keep a valid map
+            save_rescue_map(map_path, &state, 0);
+            break;
+        }
+        save_rescue_map(map_path, &state, 0);
+    }
+
+    if (state.bad_count > 0) {
+        message_begin();
+        message_text("Rescue: ");
+        message_number(state.size - bad_bytes(state.bad, state.bad_count));
+        message_text(" of ");
+        message_number(state.size);
+        message_text(" bytes rescued; ");
+        message_number(bad_bytes(state.bad, state.bad_count));
+        message_text(" bytes in ");
+        message_number((unsigned long long)state.bad_count);
+        message_text(" areas are unreadable (listed in '");
+        message_text(map_path);
+        message_text("')\n");
+        message_send(STDERR_FILENO);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * ========================================================================
+ * Sampled verification (--verify sample:P[:SEED])
+ * ========================================================================
+ *
+ * Reading the whole copy back is as expensive as the copy. Instead we
+ * compare a random P percent of the VERIFY_BLOCK blocks of source and
+ * destination, plus always the first and the last block (headers and
+ * truncated tails are where copies most often go wrong).
+ *
+ * Block i is picked when hash(seed, i) falls below P - so the choice is
+ * random, but the same seed picks exactly the same blocks on every run
+ * and every machine, and a failure can be reproduced. Picked blocks are
+ * read in increasing offset order. VERIFY_QUEUE_DEPTH picked blocks
+ * ahead are requested with POSIX_FADV_WILLNEED, so the device always
+ * has a deep queue of sorted reads while we compare.
+ *
+ * The destination is flushed and dropped from the page cache first:
+ * otherwise we would only compare the source with our own cached
+ * writes, not with what reached the device.
+ *
+ * If all picked blocks match, we report how many bad blocks could still
+ * be hiding: with n random picks out of M blocks, D bad blocks all stay
+ * unpicked with probability at most (1 - n/M)^D <= e^(-D * n/M). That is
+ * at most 5% once D >= ln(20) * M / n, which is the bound printed at 95%
+ * confidence - integer math only, and never smaller than the exact one.
+ */
+
+/*
+ * Helper function: Parse "sample:P" or "sample:P:SEED"
+ *
+ * P is a percentage with up to 4 decimals ("0.05", "2", "100"); it is
+ * stored in *ppm as parts per million of the blocks.
+ *
+ * Returns 0 on success, -1 if the text is not valid.
+ */
+int parse_verify_spec(const char *text, unsigned long long *ppm, unsigned long long *seed) {
+    const char *rest = skip_prefix(text, "sample:");
+    int pos = 0;
+    unsigned long long whole;
+    unsigned long long fraction = 0;
+    unsigned long long scale = 10000;
+
+    if (rest == 0 || parse_number(rest, &pos, &whole) == -1) {
+        return -1;
+    }
+    if (rest[pos] == '.') {
+        pos++;
+        while (rest[pos] >= '0' && rest[pos] <= '9' && scale > 1) {
+            scale /= 10;
+            fraction += (unsigned long long)(rest[pos] - '0') * scale;
+            pos++;
+        }
+    }
+    *ppm = whole * 10000 + fraction;
+    *seed = 1;
+    if (rest[pos] == ':') {
+        pos++;
+        if (parse_number(rest, &pos, seed) == -1) {
+            return -1;
+        }
+    }
+    return (rest[pos] == '\0' && *ppm > 0 && *ppm <= 1000000) ? 0 : -1;
+}
+
+/*
+ * Helper function: Mix seed and block number into a random-looking
+ * number (SplitMix64 finalizer)
+ */
+unsigned long long verify_hash(unsigned long long seed, unsigned long long block) {
+    unsigned long long x = seed ^ (block * 0x9E3779B97F4A7C15ULL);
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+/*
+ * Helper function: Is block picked (first and last always are)?
+ */
+int verify_picked(unsigned long long block, unsigned long long blocks,
+                  unsigned long long ppm, unsigned long long seed) {
+    return block == 0 || block == blocks - 1 || verify_hash(seed, block) % 1000000 < ppm;
+}
+
+/*
+ * Helper function: Add "N.NN%" (from parts per million) to the message
+ */
+void message_percent(unsigned long long ppm) {
+    unsigned long long hundredths = ppm / 100;
+    message_number(hundredths / 100);
+    message_text(hundredths % 100 < 10 ? ".0" : ".");
+    message_number(hundredths % 100);
+    message_text("%");
+}
+
+/*
+ * Helper function: Number of bad blocks that n random picks out of
+ * blocks would miss with at most 5% probability: ln(20) * blocks / n,
+ * rounded up (and never more than blocks)
+ */
+unsigned long long verify_bound(unsigned long long n, unsigned long long blocks) {
+    unsigned long long bound = (VERIFY_LN_MISS_MILLI * blocks + 1000 * n - 1) / (1000 * n);
+    return bound < blocks ? bound : blocks;
+}
+
+/*
+ * Compare a seeded random sample of blocks of source and destination
+ *
+ * Returns 0 if every picked block matches, -1 on a mismatch or error.
+ */
+int verify_sample(int source_fd, const char *dest_file,
+                  unsigned long long ppm, unsigned long long seed) {
+    struct stat source_stat;
+    struct stat dest_stat;
+    int dest_fd = open(dest_file, O_RDONLY);
+
+    if (dest_fd == -1 || fstat(source_fd, &source_stat) == -1 ||
+        fstat(dest_fd, &dest_stat) == -1) {
+        error_message("Error: Cannot open files for --verify\n");
+        if (dest_fd != -1) {
+            close(dest_fd);
+        }
+        return -1;
+    }
+    if (source_stat.st_size != dest_stat.st_size) {
+        error_message("Verify: FAILED - destination size differs from source\n");
+        close(dest_fd);
+        return -1;
+    }
+
+    // Read the destination back from the device, not from our writes
+    fdatasync(dest_fd);
+    posix_fadvise(dest_fd, 0, 0, POSIX_FADV_DONTNEED);
+
+    unsigned long long size = (unsigned long long)source_stat.st_size;
+    unsigned long long blocks = (size + VERIFY_BLOCK - 1) / VERIFY_BLOCK;
+    unsigned long long checked = 0;
+    unsigned long long random_picks = 0;
+    unsigned long long ahead = 0;   // Next block to consider for prefetching
+    int queued = 0;                 // Picked blocks prefetched but not yet read
+    char *source_data = buffer;
+    char *dest_data = buffer + MAX_BUFFER_SIZE / 2;
+
+    for (unsigned long long block = 0; block < blocks; block++) {
+        if (!verify_picked(block, blocks, ppm, seed)) {
+            continue;
+        }
+
+        /*
+         * Keep VERIFY_QUEUE_DEPTH picked blocks requested ahead of us
+         */
+        if (ahead <= block) {
+            ahead = block;
+            queued = 0;
+        }
+        else {
+            queued--;  // This one was prefetched
+        }
+        while (queued < VERIFY_QUEUE_DEPTH && ahead < blocks) {
+            if (verify_picked(ahead, blocks, ppm, seed)) {
+                off_t offset = (off_t)(ahead * VERIFY_BLOCK);
+                posix_fadvise(source_fd, offset, VERIFY_BLOCK, POSIX_FADV_WILLNEED);
+                posix_fadvise(dest_fd, offset, VERIFY_BLOCK, POSIX_FADV_WILLNEED);
+                if (ahead != block) {
+                    queued++;
+                }
+            }
+            ahead++;
+        }
+
+        off_t offset = (off_t)(block * VERIFY_BLOCK);
+        ssize_t got = pread(source_fd, source_data, VERIFY_BLOCK, offset);
+        ssize_t got_dest = pread(dest_fd, dest_data, VERIFY_BLOCK, offset);
+        int same = got >= 0 && got == got_dest;
+        for (ssize_t i = 0; same && i < got; i++) {
+            same = source_data[i] == dest_data[i];
+        }
+        if (!same) {
+            message_begin();
+            message_text("Verify: FAILED - block at offset ");
+            message_number((unsigned long long)offset);
+            message_text(" differs (seed ");
+            message_number(seed);
+            message_text(")\n");
+            message_send(STDERR_FILENO);
+            close(dest_fd);
+            return -1;
+        }
+        checked++;
+        if (verify_hash(seed, block) % 1000000 < ppm) {
+            random_picks++;
+        }
+    }
+    close(dest_fd);
+
+    if (!quiet) {
+        message_begin();
+        message_text("Verify: ");
+        message_number(checked);
+        message_text(" of ");
+        message_number(blocks);
+        message_text(" blocks match (sample ");
+        message_percent(ppm);
+        message_text(", seed ");
+        message_number(seed);
+        message_text(")\n");
+        message_send(STDOUT_FILENO);
+        if (random_picks > 0 && random_picks < blocks) {
+            unsigned long long bound = verify_bound(random_picks, blocks);
+            message_begin();
+            message_text("        95% confidence that fewer than ");
+            message_number(bound);
+            message_text(" blocks (");
+            message_percent(bound * 1000000 / blocks);
+            message_text(") differ\n");
+            message_send(STDOUT_FILENO);
+        }
+    }
+    return 0;
+}
+
+/*
+ * ========================================================================
+ * SHA-256 of the copied data (--sha256)
+ * ========================================================================
+ *
+ * The data is hashed as it passes through the copy loop, so the digest
+ * costs no extra read. The line printed is exactly what sha256sum prints
+ * for the destination, so it can be appended to an existing manifest and
+ * checked with "sha256sum -c".
+ *
+ * The 64-byte block function has three versions: plain C, the x86 SHA
+ * extensions (SHA-NI, picked at run time with CPUID), and the ARMv8
+ * crypto extensions (picked at build time, when the compiler targets
+ * them).
+ */
+struct sha256_state {
+    unsigned int h[8];
+    unsigned char block[64];   // Partial block waiting for more data
+    unsigned int used;         // Bytes in block
+    unsigned long long length; // Total bytes hashed
+};
+
+static const unsigned int sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+unsigned int rotate_right(unsigned int x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+/*
+ * Helper function: Hash whole 64-byte blocks in plain C
+ */
+void sha256_blocks_scalar(unsigned int h[8], const unsigned char *data, size_t blocks) {
+    unsigned int w[64];
+    for (size_t b = 0; b < blocks; b++, data += 64) {
+        for (int i = 0; i < 16; i++) {
+            w[i] = (unsigned int)data[4 * i] << 24 | (unsigned int)data[4 * i + 1] << 16 |
+                   (unsigned int)data[4 * i + 2] << 8 | (unsigned int)data[4 * i + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            unsigned int s0 = rotate_right(w[i - 15], 7) ^ rotate_right(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            unsigned int s1 = rotate_right(w[i - 2], 17) ^ rotate_right(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        unsigned int a = h[0], b2 = h[1], c = h[2], d = h[3];
+        unsigned int e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i = 0; i < 64; i++) {
+            unsigned int t1 = hh + (rotate_right(e, 6) ^ rotate_right(e, 11) ^ rotate_right(e, 25)) +
+                              ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+            unsigned int t2 = (rotate_right(a, 2) ^ rotate_right(a, 13) ^ rotate_right(a, 22)) +
+                              ((a & b2) ^ (a & c) ^ (b2 & c));
+            hh = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b2;
+            b2 = a;
+            a = t1 + t2;
+        }
+        h[0] += a; h[1] += b2; h[2] += c; h[3] += d;
+        h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * Helper function: Hash whole 64-byte blocks with the SHA-NI instructions
+ *
+ * SHA256RNDS2 does two rounds on the state split as ABEF/CDGH, and
+ * SHA256MSG1/MSG2 compute the message schedule four words at a time.
+ */
+__attribute__((target("sha,sse4.1,ssse3")))
+void sha256_blocks_shani(unsigned int h[8], const unsigned char *data, size_t blocks) {
+    const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bLL, 0x0405060700010203LL);
+
+    // h[0..7] = A..H  ->  state0 = ABEF, state1 = CDGH
+    __m128i tmp = _mm_loadu_si128((const __m128i *)&h[0]);     // DCBA
+    __m128i state1 = _mm_loadu_si128((const __m128i *)&h[4]);  // HGFE
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);                        // CDAB
+    state1 = _mm_shuffle_epi32(state1, 0x1B);                  // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);          // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);               // CDGH
+
+    for (size_t b = 0; b < blocks; b++, data += 64) {
+        __m128i save0 = state0;
+        __m128i save1 = state1;
+        __m128i msg[4];
+        for (int i = 0; i < 4; i++) {
+            msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * i)), byte_swap);
+        }
+
+        /*
+         * 16 groups of 4 rounds. Group i uses message words msg[i % 4],
+         * and from group 3 on builds the words for group i + 1.
+         */
+        for (int i = 0; i < 16; i++) {
+            __m128i current = msg[i % 4];
+            __m128i words = _mm_add_epi32(current, _mm_loadu_si128((const __m128i *)&sha256_k[4 * i]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, words);
+            if (i >= 3 && i < 15) {
+                __m128i next = msg[(i + 1) % 4];
+                next = _mm_add_epi32(next, _mm_alignr_epi8(current, msg[(i + 3) % 4], 4));
+                msg[(i + 1) % 4] = _mm_sha256msg2_epu32(next, current);
+            }
+            words = _mm_shuffle_epi32(words, 0x0E);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, words);
+            if (i >= 1 && i < 13) {
+                msg[(i + 3) % 4] = _mm_sha256msg1_epu32(msg[(i + 3) % 4], current);
+            }
+        }
+
+        state0 = _mm_add_epi32(state0, save0);
+        state1 = _mm_add_epi32(state1, save1);
+    }
+
+    // ABEF/CDGH back to A..H
+    tmp = _mm_shuffle_epi32(state0, 0x1B);                     // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xB1);                  // DCHG
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);               // DCBA
+    state1 = _mm_alignr_epi8(state1, tmp, 8);                  // HGFE
+    _mm_storeu_si128((__m128i *)&h[0], state0);
+    _mm_storeu_si128((__m128i *)&h[4], state1);
+}
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_SHA2)
+/*
+ * Helper function: Hash whole 64-byte blocks with the ARMv8 SHA-256
+ * instructions (SHA256H/H2 for four rounds, SU0/SU1 for the schedule)
+ */
+void sha256_blocks_arm(unsigned int h[8], const unsigned char *data, size_t blocks) {
+    uint32x4_t state0 = vld1q_u32(&h[0]);
+    uint32x4_t state1 = vld1q_u32(&h[4]);
+
+    for (size_t b = 0; b < blocks; b++, data += 64) {
+        uint32x4_t save0 = state0;
+        uint32x4_t save1 = state1;
+        uint32x4_t msg[4];
+        for (int i = 0; i < 4; i++) {
+            msg[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * i)));
+        }
+
+        for (int i = 0; i < 16; i++) {
+            uint32x4_t words = vaddq_u32(msg[i % 4], vld1q_u32(&sha256_k[4 * i]));
+            if (i < 12) {
+                msg[i % 4] = vsha256su1q_u32(vsha256su0q_u32(msg[i % 4], msg[(i + 1) % 4]),
+                                             msg[(i + 2) % 4], msg[(i + 3) % 4]);
+            }
+            uint32x4_t previous = state0;
+            state0 = vsha256hq_u32(state0, state1, words);
+            state1 = vsha256h2q_u32(state1, previous, words);
+        }
+
+        state0 = vaddq_u32(state0, save0);
+        state1 = vaddq_u32(state1, save1);
+    }
+    vst1q_u32(&h[0], state0);
+    vst1q_u32(&h[4], state1);
+}
+#endif
+
+/*
+ * Helper function: Hash whole 64-byte blocks with the fastest version
+ * this CPU has
+ */
+void sha256_blocks(unsigned int h[8], const unsigned char *data, size_t blocks) {
+#if defined(__x86_64__) || defined(__i386__)
+    static int shani = -1;  // -1 = not checked yet
+    if (shani == -1) {
+        unsigned int eax, ebx, ecx, edx;
+        // CPUID leaf 7: EBX bit 29 = SHA extensions
+        shani = __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx >> 29 & 1) &&
+                __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx >> 19 & 1);  // + SSE4.1
+    }
+    if (shani) {
+        sha256_blocks_shani(h, data, blocks);
+        return;
+    }
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_SHA2)
+    sha256_blocks_arm(h, data, blocks);
+    return;
+#endif
+    sha256_blocks_scalar(h, data, blocks);
+}
+
+void sha256_init(struct sha256_state *state) {
+    static const unsigned int initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    for (int i = 0; i < 8; i++) {
+        state->h[i] = initial[i];
+    }
+    state->used = 0;
+    state->length = 0;
+}
+
+void sha256_update(struct sha256_state *state, const char *data, size_t length) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    state->length += length;
+
+    // Top up a partial block first
+    while (state->used > 0 && length > 0) {
+        state->block[state->used++] = *bytes++;
+        length--;
+        if (state->used == 64) {
+            sha256_blocks(state->h, state->block, 1);
+            state->used = 0;
+        }
+    }
+    // Whole blocks straight from the caller's buffer
+    sha256_blocks(state->h, bytes, length / 64);
+    bytes += length / 64 * 64;
+    length %= 64;
+    while (length > 0) {
+        state->block[state->used++] = *bytes++;
+        length--;
+    }
+}
+
+/*
+ * Helper function: Finish the hash and write it as 64 hex digits
+ */
+void sha256_final(struct sha256_state *state, char hex[65]) {
+    unsigned long long bits = state->length * 8;
+    unsigned char padding[72];
+    size_t pad_length = (state->used < 56) ? 56 - state->used : 120 - state->used;
+
+    padding[0] = 0x80;
+    for (size_t i = 1; i < pad_length; i++) {
+        padding[i] = 0;
+    }
+    for (int i = 0; i < 8; i++) {
+        padding[pad_length + i] = (unsigned char)(bits >> (56 - 8 * i));
+    }
+    unsigned long long length = state->length;
+    sha256_update(state, (const char *)padding, pad_length + 8);
+    state->length = length;
+
+    const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 8; j++) {
+            hex[8 * i + j] = digits[(state->h[i] >> (28 - 4 * j)) & 0xF];
+        }
+    }
+    hex[64] = '\0';
+}
+
+/*
+ * Helper function: Hash a whole file from the start
+ *
+ * Returns 0 on success, -1 on a read error.
+ */
+int sha256_file(int fd, char hex[65]) {
+    struct sha256_state state;
+    off_t offset = 0;
+    ssize_t got;
+    sha256_init(&state);
+    while ((got = pread(fd, buffer, MAX_BUFFER_SIZE, offset)) > 0) {
+        sha256_update(&state, buffer, (size_t)got);
+        offset += got;
+    }
+    sha256_final(&state, hex);
+    return got == 0 ? 0 : -1;
+}
+
+/*
+ * Helper function: Print a digest line the way sha256sum does
+ *
+ *     <64 hex digits>  <file name>
+ *
+ * A name containing a backslash, newline or carriage return is escaped
+ * ("\\\\", "\\n", "\\r") and the line then starts with a backslash, again
+ * like sha256sum (coreutils 9.x).
+ */
+void print_sha256(const char hex[65], const char *file) {
+    char escaped[2 * PATH_LENGTH];
+    int needs_escape = 0;
+    int pos = 0;
+    for (int i = 0; file[i] != '\0' && pos < (int)sizeof(escaped) - 3; i++) {
+        if (file[i] == '\\' || file[i] == '\n' || file[i] == '\r') {
+            escaped[pos++] = '\\';
+            escaped[pos++] = (file[i] == '\n') ? 'n' : (file[i] == '\r') ? 'r' : '\\';
+            needs_escape = 1;
+        }
+        else {
+            escaped[pos++] = file[i];
+        }
+    }
+    escaped[pos] = '\0';
+
+    message_begin();
+    message_text(needs_escape ? "\\" : "");
+    message_text(hex);
+    message_text("  ");
+    message_text(escaped);
+    message_text("\n");
+    message_send(STDOUT_FILENO);
+}
+
+/*
+ * ========================================================================
+ * Source analysis (--analyze FILE)
+ * ========================================================================
+ *
+ * Before a big migration it helps to know what is being copied. This
+ * reports what matters for the copy and which options to use, reading
+ * at most ANALYZE_SAMPLES * ANALYZE_SAMPLE_BYTES (16 MB) of the file:
+ *
+ * - size, allocated space and holes (SEEK_DATA/SEEK_HOLE, no reads)
+ * - hard link count and how much of the file is in the page cache
+ * - from evenly spaced samples: zero pages, duplicate pages and the
+ *   byte entropy, which bounds how well the data would compress
+ *
+ * All sample offsets are requested up front with POSIX_FADV_WILLNEED, so
+ * the device gets one deep, sorted queue of reads instead of 256 single
+ * waits.
+ */
+
+/*
+ * Helper function: log2(x) for x >= 1, in 1/65536ths (LOG2_ONE)
+ *
+ * The highest set bit gives the integer part. The rest of x, scaled to
+ * [1, 2) in 31-bit fixed point, gives the fraction bit by bit: squaring
+ * a number in [1, 2) doubles its log, so the square reaching 2 means
+ * the next fraction bit is 1.
+ */
+unsigned long long log2_fixed(unsigned long long x) {
+    int top = 63;
+    while (top > 0 && (x >> top) == 0) {
+        top--;
+    }
+    unsigned long long result = (unsigned long long)top * LOG2_ONE;
+    unsigned long long m = (top >= 31) ? x >> (top - 31) : x << (31 - top);
+
+    for (unsigned long long bit = LOG2_ONE / 2; bit > 0; bit /= 2) {
+        m = (m * m) >> 31;  // m < 2^32, so this cannot overflow
+        if (m >= (1ULL << 32)) {
+            m >>= 1;
+            result += bit;
+        }
+    }
+    return result;
+}
+
+/*
+ * Helper function: 64-bit FNV-1a hash of a page (for duplicate counting)
+ */
+unsigned long long page_hash(const unsigned char *data, size_t length) {
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ data[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/*
+ * Helper function: Print "<label><whole>.<2 digits><unit>"
+ * from a value in hundredths
+ */
+void report_hundredths(const char *label, unsigned long long hundredths, const char *unit) {
+    message_begin();
+    message_text(label);
+    message_number(hundredths / 100);
+    message_text(hundredths % 100 < 10 ? ".0" : ".");
+    message_number(hundredths % 100);
+    message_text(unit);
+    message_send(STDOUT_FILENO);
+}
+
+/*
+ * Analyze a source file and recommend how to copy it (--analyze)
+ *
+ * Returns 0 on success, 1 on error.
+ */
+int analyze_file(const char *file, const char *profiles) {
+    static unsigned long long hashes[ANALYZE_SAMPLES * (ANALYZE_SAMPLE_BYTES / ANALYZE_PAGE)];
+    unsigned long long histogram[256];
+    struct stat st;
+    int fd = open(file, O_RDONLY);
+
+    if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        message_begin();
+        message_text("Error: Cannot analyze '");
+        message_text(file);
+        message_text("' - it must be a readable regular file\n");
+        message_send(STDERR_FILENO);
+        if (fd != -1) {
+            close(fd);
+        }
+        return 1;
+    }
+    unsigned long long size = (unsigned long long)st.st_size;
+
+    /*
+     * Page cache first - our own sample reads would change it
+     */
+    long long size_kb = 0;
+    long long cached_kb = resident_kb_fd(fd, &size_kb);
+    long long cached_percent = (cached_kb >= 0 && size_kb > 0) ? cached_kb * 100 / size_kb : 0;
+    if (cached_percent > 100) {
+        cached_percent = 100;  // A cached last page counts whole
+    }
+
+    /*
+     * Holes: walk the data extents (the filesystem knows, nothing is read)
+     */
+    unsigned long long data_bytes = 0;
+    off_t offset = 0;
+    while ((unsigned long long)offset < size) {
+        off_t data = lseek(fd, offset, SEEK_DATA);
+        if (data == -1) {
+            break;  // Only holes from here on (or no SEEK_DATA support: see below)
+        }
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole == -1) {
+            hole = (off_t)size;
+        }
+        data_bytes += (unsigned long long)(hole - data);
+        offset = hole;
+    }
+    if (data_bytes == 0 && st.st_blocks > 0) {
+        data_bytes = size;  // SEEK_DATA not supported - assume no holes
+    }
+
+    /*
+     * Samples: the whole file if it is small, otherwise ANALYZE_SAMPLES
+     * evenly spaced pieces
+     */
+    unsigned long long samples = (size + ANALYZE_SAMPLE_BYTES - 1) / ANALYZE_SAMPLE_BYTES;
+    if (samples > ANALYZE_SAMPLES) {
+        samples = ANALYZE_SAMPLES;
+    }
+    unsigned long long stride = ANALYZE_SAMPLE_BYTES;  // Small file: all of it
+    if (samples == ANALYZE_SAMPLES && size / samples > stride) {
+        stride = size / samples;
+        stride -= stride % ANALYZE_PAGE;
+    }
+    for (unsigned long long i = 0; i < samples; i++) {
+        posix_fadvise(fd, (off_t)(i * stride), ANALYZE_SAMPLE_BYTES, POSIX_FADV_WILLNEED);
+    }
+
+    for (int b = 0; b < 256; b++) {
+        histogram[b] = 0;
+    }
+    unsigned long long sampled_bytes = 0;
+    unsigned long long pages = 0;
+    unsigned long long zero_pages = 0;
+    int hash_count = 0;
+    unsigned char *data = (unsigned char *)buffer;
+
+    for (unsigned long long i = 0; i < samples; i++) {
+        ssize_t got = pread(fd, data, ANALYZE_SAMPLE_BYTES, (off_t)(i * stride));
+        if (got <= 0) {
+            continue;
+        }
+        for (ssize_t j = 0; j < got; j++) {
+            histogram[data[j]]++;
+        }
+        sampled_bytes += (unsigned long long)got;
+        for (ssize_t page = 0; page < got; page += ANALYZE_PAGE) {
+            size_t length = (size_t)(got - page) < ANALYZE_PAGE ? (size_t)(got - page) : ANALYZE_PAGE;
+            int zero = 1;
+            for (size_t j = 0; zero && j < length; j++) {
+                zero = data[page + j] == 0;
+            }
+            pages++;
+            if (zero) {
+                zero_pages++;
+            }
+            else {
+                hashes[hash_count++] = page_hash(data + page, length);
+            }
+        }
+    }
+    close(fd);
+
+    /*
+     * Duplicates: sort the page hashes (Shell sort) and count repeats
+     */
+    for (int gap = hash_count / 2; gap > 0; gap /= 2) {
+        for (int i = gap; i < hash_count; i++) {
+            unsigned long long value = hashes[i];
+            int j = i;
+            while (j >= gap && hashes[j - gap] > value) {
+                hashes[j] = hashes[j - gap];
+                j -= gap;
+            }
+            hashes[j] = value;
+        }
+    }
+    unsigned long long duplicate_pages = 0;
+    for (int i = 1; i < hash_count; i++) {
+        if (hashes[i] == hashes[i - 1]) {
+            duplicate_pages++;
+        }
+    }
+
+    /*
+     * Order-0 entropy in bits per byte (in 1/65536ths): 8 = random,
+     * 0 = one byte value. With n bytes sampled and c of byte value b,
+     *     entropy = log2(n) - sum over b of c * log2(c) / n
+     * Rounding can push it a hair outside [0, 8], so clamp it.
+     */
+    unsigned long long entropy = 0;
+    if (sampled_bytes > 0) {
+        unsigned long long sum = 0;
+        for (int b = 0; b < 256; b++) {
+            if (histogram[b] > 0) {
+                sum += histogram[b] * log2_fixed(histogram[b]);
+            }
+        }
+        unsigned long long whole = log2_fixed(sampled_bytes);
+        entropy = (sum / sampled_bytes < whole) ? whole - sum / sampled_bytes : 0;
+        if (entropy > 8 * LOG2_ONE) {
+            entropy = 8 * LOG2_ONE;
+        }
+    }
+
+    /*
+     * Report
+     */
+    message_begin();
+    message_text("Analysis of '");
+    message_text(file);
+    message_text("'\n");
+    message_send(STDOUT_FILENO);
+
+    message_begin();
+    message_text("  Size:             ");
+    message_number(size);
+    message_text(" bytes\n");
+    message_send(STDOUT_FILENO);
+
+    message_begin();
+    message_text("  Allocated:        ");
+    message_number((unsigned long long)st.st_blocks * 512);
+    message_text(" bytes\n");
+    message_send(STDOUT_FILENO);
+
+    report_hundredths("  Holes:            ",
+                      size > 0 ? (size - data_bytes) * 10000 / size : 0, "% of the file\n");
+
+    message_begin();
+    message_text("  Hard links:       ");
+    message_number((unsigned long long)st.st_nlink);
+    message_text("\n  Cached:           ");
+    message_number((unsigned long long)cached_percent);
+    message_text("%\n  Sampled:          ");
+    message_number(sampled_bytes);
+    message_text(" bytes in ");
+    message_number(samples);
+    message_text(" pieces\n");
+    message_send(STDOUT_FILENO);
+
+    report_hundredths("  Zero pages:       ", pages > 0 ? zero_pages * 10000 / pages : 0,
+                      "% of sampled pages\n");
+    report_hundredths("  Duplicate pages:  ", pages > 0 ? duplicate_pages * 10000 / pages : 0,
+                      "% of sampled pages\n");
+    if (sampled_bytes > 0) {
+        report_hundredths("  Entropy:          ", (entropy * 100 + LOG2_ONE / 2) / LOG2_ONE,
+                          " bits per byte\n");
+        report_hundredths("  Compressibility:  about ",
+                          ((8 * LOG2_ONE - entropy) * 10000 + 4 * LOG2_ONE) / (8 * LOG2_ONE),
+                          "% smaller (byte-entropy estimate)\n");
+    }
+    else {
+        message_begin();
+        message_text("  Entropy:          n/a (nothing sampled)\n"
+                     "  Compressibility:  n/a\n");
+        message_send(STDOUT_FILENO);
+    }
+
+    /*
+     * Recommendations - the same rules the copy itself uses
+     */
+    message_begin();
+    message_text("Recommendations:\n  Strategy:         ");
+    if (cached_percent >= CACHED_PERCENT) {
+        message_text("copy from memory (mmap) - the file is in the page cache\n");
+    }
+    else if (cached_percent < COLD_PERCENT && size >= DIRECT_MIN_BYTES) {
+        message_text("O_DIRECT - big and not cached, keep it out of the page cache\n");
+    }
+    else {
+        message_text("buffered read()/write()\n");
+    }
+    message_send(STDOUT_FILENO);
+
+    unsigned long long rate;
+    unsigned long long profile_size = lookup_profile(profiles, (unsigned long long)st.st_dev, &rate);
+    message_begin();
+    message_text("  Buffer size:      ");
+    if (profile_size > 0) {
+        message_number(profile_size);
+        message_text(" bytes (calibrated for this device)\n");
+    }
+    else {
+        message_number(BUFFER_SIZE);
+        message_text(" bytes (default) - run --calibrate on the destination to measure\n");
+    }
+    message_send(STDOUT_FILENO);
+
+    unsigned long long chunks = (size + SHARD_CHUNK - 1) / SHARD_CHUNK;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned long long shards = cpus > 0 ? (unsigned long long)cpus : 1;
+    if (shards > ANALYZE_MAX_SHARDS) {
+        shards = ANALYZE_MAX_SHARDS;
+    }
+    if (shards > chunks / 4) {
+        shards = chunks / 4;  // At least 4 chunks per process, or it is not worth it
+    }
+    message_begin();
+    message_text("  Processes:        ");
+    if (shards >= 2) {
+        message_number(shards);
+        message_text(" (--shard I/");
+        message_number(shards);
+        message_text(" --leases), if the storage handles parallel requests\n");
+    }
+    else {
+        message_text("1 - too small to be worth splitting\n");
+    }
+    message_send(STDOUT_FILENO);
+
+    if (data_bytes < size) {
+        message_begin();
+        message_text("  Note:             the copy writes holes out as zeros - ");
+        message_number(size - data_bytes);
+        message_text(" more bytes on the destination\n");
+        message_send(STDOUT_FILENO);
+    }
+    return 0;
+}
+
+/*
+ * ========================================================================
+ * Reed-Solomon parity (--parity K+M, --repair)
+ * ========================================================================
+ *
+ * The copied data is cut into stripes of K blocks of PARITY_BLOCK bytes.
+ * For every stripe we compute M parity blocks, so that ANY K of the
+ * K + M blocks are enough to rebuild the stripe. Parity file j gets
+ * parity block j of every stripe.
+ *
+ * The math is done in GF(2^8): "adding" bytes is XOR, and multiplying
+ * uses log/exp tables. Parity block j is
+ *     P[j] = sum over d of C[j][d] * D[d]
+ * where C is a Cauchy matrix - every square piece of it can be inverted,
+ * which is exactly what guarantees that any K blocks are enough.
+ *
+ * Parity file layout (native byte order):
+ *     struct parity_header (K, M, and the size and mtime of the file it
+ *                           was made for: --repair refuses any other file)
+ *     then for every stripe:
+ *         K x 4 bytes   CRC32 of each data block (to find damaged blocks)
+ *         4 bytes       CRC32 of the CRC list + parity block
+ *         PARITY_BLOCK  parity bytes
+ */
+
+struct parity_header {
+    char magic[8];                 // "MYCPPAR1"
+    unsigned int k;                // Data blocks per stripe
+    unsigned int m;                // Parity blocks per stripe
+    unsigned int index;            // Which parity block this file holds
+    unsigned int block_size;       // PARITY_BLOCK
+    unsigned long long file_size;  // Size of the protected file
+    long long mtime_sec;           // Its mtime when the parity was finished
+    long long mtime_nsec;
+};
+
+struct parity_state {
+    int k;
+    int m;
+    int fds[MAX_PARITY_BLOCKS];
+    unsigned char coef[MAX_PARITY_BLOCKS][MAX_DATA_BLOCKS];
+    unsigned int crcs[MAX_DATA_BLOCKS];  // CRC32 of each data block so far
+    unsigned long long stripe_fill;      // Bytes of the current stripe seen
+    unsigned long long total;            // Bytes of the file seen
+};
+
+static unsigned char gf_exp[512];
+static unsigned char gf_log[256];
+static unsigned int crc_table[256];
+static unsigned char parity_blocks[MAX_PARITY_BLOCKS][PARITY_BLOCK];
+static unsigned char data_blocks[MAX_DATA_BLOCKS][PARITY_BLOCK];
+
+/*
+ * Build the GF(2^8) log/exp tables (polynomial x^8+x^4+x^3+x^2+1)
+ * and the CRC32 table
+ */
+void parity_init_tables(void) {
+    unsigned int x = 1;
+    for (int i = 0; i < 255; i++) {
+        gf_exp[i] = (unsigned char)x;
+        gf_log[x] = (unsigned char)i;
+        x <<= 1;
+        if (x & 0x100) {
+            x ^= 0x11d;
+        }
+    }
+    // Doubled so gf_mul() never needs "% 255"
+    for (int i = 255; i < 512; i++) {
+        gf_exp[i] = gf_exp[i - 255];
+    }
+
+    for (unsigned int i = 0; i < 256; i++) {
+        unsigned int c = i;
+        for (int bit = 0; bit < 8; bit++) {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+}
+
+unsigned char gf_mul(unsigned char a, unsigned char b) {
+    if (a == 0 || b == 0) {
+        return 0;
+    }
+    return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+unsigned char gf_inv(unsigned char a) {
+    return gf_exp[255 - gf_log[a]];
+}
+
+/*
+ * Helper function: CRC32 (same as zlib) - feed data piece by piece,
+ * starting from crc = 0
+ */
+unsigned int crc32_update(unsigned int crc, const unsigned char *data, size_t length) {
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) {
+        crc = crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/*
+ * dst[i] ^= c * src[i] for a whole region - the inner loop of Reed-Solomon
+ *
+ * Any byte x is (high nibble << 4) ^ (low nibble), and multiplication
+ * distributes over XOR, so c * x = hi_table[x >> 4] ^ lo_table[x & 15].
+ * With two 16-entry tables, PSHUFB (SSSE3) looks up 16 bytes at once and
+ * VPSHUFB (AVX2) 32 bytes. The scalar loop handles other CPUs and tails.
+ */
+void gf_mul_add_scalar(unsigned char *dst, const unsigned char *src,
+                       unsigned char c, size_t length) {
+    if (c == 0) {
+        return;
+    }
+    unsigned int log_c = gf_log[c];
+    for (size_t i = 0; i < length; i++) {
+        if (src[i] != 0) {
+            dst[i] ^= gf_exp[log_c + gf_log[src[i]]];
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("ssse3")))
+size_t gf_mul_add_ssse3(unsigned char *dst, const unsigned char *src,
+                        const unsigned char *lo, const unsigned char *hi, size_t length) {
+    __m128i lo_table = _mm_loadu_si128((const __m128i *)lo);
+    __m128i hi_table = _mm_loadu_si128((const __m128i *)hi);
+    __m128i mask = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i low = _mm_shuffle_epi8(lo_table, _mm_and_si128(x, mask));
+        __m128i high = _mm_shuffle_epi8(hi_table, _mm_and_si128(_mm_srli_epi64(x, 4), mask));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, _mm_xor_si128(low, high)));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+size_t gf_mul_add_avx2(unsigned char *dst, const unsigned char *src,
+                       const unsigned char *lo, const unsigned char *hi, size_t length) {
+    __m256i lo_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lo));
+    __m256i hi_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hi));
+    __m256i mask = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i low = _mm256_shuffle_epi8(lo_table, _mm256_and_si256(x, mask));
+        __m256i high = _mm256_shuffle_epi8(hi_table,
+                                           _mm256_and_si256(_mm256_srli_epi64(x, 4), mask));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(d, _mm256_xor_si256(low, high)));
+    }
+    return i;
+}
+#endif
+
+void gf_mul_add(unsigned char *dst, const unsigned char *src, unsigned char c, size_t length) {
+    size_t done = 0;
+    if (c == 0) {
+        return;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    static int simd = -1;  // -1 = not checked yet, 0 = none, 1 = SSSE3, 2 = AVX2
+    if (simd == -1) {
+        __builtin_cpu_init();
+        simd = __builtin_cpu_supports("avx2") ? 2 : __builtin_cpu_supports("ssse3") ? 1 : 0;
+    }
+    if (simd > 0) {
+        unsigned char lo[16];
+        unsigned char hi[16];
+        for (int i = 0; i < 16; i++) {
+            lo[i] = gf_mul(c, (unsigned char)i);
+            hi[i] = gf_mul(c, (unsigned char)(i << 4));
+        }
+        done = (simd == 2) ? gf_mul_add_avx2(dst, src, lo, hi, length)
+                           : gf_mul_add_ssse3(dst, src, lo, hi, length);
+    }
+#endif
+    gf_mul_add_scalar(dst + done, src + done, c, length - done);
+}
+
+/*
+ * Helper function: Parse "K+M" for --parity
+ *
+ * Returns 0 on success, -1 if the text is not a valid K+M.
+ */
+int parse_parity_spec(const char *text, int *k, int *m) {
+    int pos = 0;
+    unsigned long long data_count;
+    unsigned long long parity_count;
+    if (parse_number(text, &pos, &data_count) == -1 || text[pos++] != '+' ||
+        parse_number(text, &pos, &parity_count) == -1 || text[pos] != '\0') {
+        return -1;
+    }
+    if (data_count < 1 || data_count > MAX_DATA_BLOCKS ||
+        parity_count < 1 || parity_count > MAX_PARITY_BLOCKS) {
+        return -1;
+    }
+    *k = (int)data_count;
+    *m = (int)parity_count;
+    return 0;
+}
+
+/*
+ * Helper function: Build "<file>.par<index>"
+ */
+int parity_path(const char *file, int index, char *path) {
+    int pos = append_string(path, 0, file);
+    pos = append_string(path, pos, ".par");
+    return append_number(path, pos, (unsigned long long)index) == -1 ? -1 : 0;
+}
+
+/*
+ * Helper function: Fill in the Cauchy matrix C[j][d] = 1 / (x_j + y_d)
+ * with x_j = j and y_d = m + d (all different, so x_j + y_d is never 0)
+ */
+void parity_matrix(int k, int m, unsigned char coef[][MAX_DATA_BLOCKS]) {
+    for (int j = 0; j < m; j++) {
+        for (int d = 0; d < k; d++) {
+            coef[j][d] = gf_inv((unsigned char)(j ^ (m + d)));
+        }
+    }
+}
+
+void parity_fill_header(struct parity_header *header, int k, int m, int index,
+                        const struct stat *file_stat) {
+    const char magic[8] = {'M', 'Y', 'C', 'P', 'P', 'A', 'R', '1'};
+    for (int i = 0; i < 8; i++) {
+        header->magic[i] = magic[i];
+    }
+    header->k = (unsigned int)k;
+    header->m = (unsigned int)m;
+    header->index = (unsigned int)index;
+    header->block_size = PARITY_BLOCK;
+    header->file_size = file_stat ? (unsigned long long)file_stat->st_size : 0;
+    header->mtime_sec = file_stat ? (long long)file_stat->st_mtim.tv_sec : 0;
+    header->mtime_nsec = file_stat ? (long long)file_stat->st_mtim.tv_nsec : 0;
+}
+
+/*
+ * Helper function: Delete "<file>.par<first>", "<file>.par<first+1>", ...
+ * up to the first one that does not exist
+ */
+void remove_parity_files(const char *file, int first) {
+    for (int j = first; j <= MAX_PARITY_BLOCKS; j++) {
+        char path[PATH_LENGTH];
+        if (parity_path(file, j, path) == -1 || unlink(path) == -1) {
+            return;
+        }
+    }
+}
+
+/*
+ * Create the M parity files next to the destination
+ *
+ * Returns 0 on success, -1 on error (nothing left open).
+ */
+int parity_open(struct parity_state *state, const char *dest_file, int k, int m) {
+    state->k = k;
+    state->m = m;
+    state->stripe_fill = 0;
+    state->total = 0;
+    parity_init_tables();
+    parity_matrix(k, m, state->coef);
+
+    for (int j = 0; j < m; j++) {
+        char path[PATH_LENGTH];
+        struct parity_header header;
+        parity_fill_header(&header, k, m, j, 0);  // Size and mtime are filled in at the end
+
+        state->fds[j] = -1;
+        if (parity_path(dest_file, j + 1, path) == 0) {
+            state->fds[j] = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        }
+        if (state->fds[j] == -1 ||
+            write(state->fds[j], &header, sizeof(header)) != (ssize_t)sizeof(header)) {
+            message_begin();
+            message_text("Error: Cannot create parity file for '");
+            message_text(dest_file);
+            message_text("'\n");
+            message_send(STDERR_FILENO);
+            for (int i = 0; i <= j; i++) {
+                if (state->fds[i] != -1) {
+                    close(state->fds[i]);
+                }
+            }
+            return -1;
+        }
+        for (int i = 0; i < PARITY_BLOCK; i++) {
+            parity_blocks[j][i] = 0;
+        }
+    }
+    for (int d = 0; d < k; d++) {
+        state->crcs[d] = 0;
+    }
+    return 0;
+}
+
+/*
+ * Write the finished stripe's record to every parity file and start
+ * a new stripe
+ */
+int parity_flush_stripe(struct parity_state *state) {
+    for (int j = 0; j < state->m; j++) {
+        unsigned int record_crc = crc32_update(0, (const unsigned char *)state->crcs,
+                                               sizeof(unsigned int) * state->k);
+        record_crc = crc32_update(record_crc, parity_blocks[j], PARITY_BLOCK);
+
+        ssize_t list_size = (ssize_t)(sizeof(unsigned int) * state->k);
+        if (write(state->fds[j], state->crcs, list_size) != list_size ||
+            write(state->fds[j], &record_crc, sizeof(record_crc)) != (ssize_t)sizeof(record_crc) ||
+            write(state->fds[j], parity_blocks[j], PARITY_BLOCK) != PARITY_BLOCK) {
+            return -1;
+        }
+        for (int i = 0; i < PARITY_BLOCK; i++) {
+            parity_blocks[j][i] = 0;
+        }
+    }
+    for (int d = 0; d < state->k; d++) {
+        state->crcs[d] = 0;
+    }
+    state->stripe_fill = 0;
+    return 0;
+}
+
+/*
+ * Feed copied data into the parity computation
+ *
+ * Called with every chunk the copy loop writes, so the data is never
+ * read twice. Chunks can be any size; they are split at block edges.
+ *
+ * Returns 0 on success, -1 if a parity file cannot be written.
+ */
+int parity_add(struct parity_state *state, const char *data, size_t length) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    unsigned long long stripe_size = (unsigned long long)state->k * PARITY_BLOCK;
+
+    while (length > 0) {
+        int d = (int)(state->stripe_fill / PARITY_BLOCK);
+        size_t in_block = (size_t)(state->stripe_fill % PARITY_BLOCK);
+        size_t piece = PARITY_BLOCK - in_block;
+        if (piece > length) {
+            piece = length;
+        }
+
+        state->crcs[d] = crc32_update(state->crcs[d], bytes, piece);
+        for (int j = 0; j < state->m; j++) {
+            gf_mul_add(parity_blocks[j] + in_block, bytes, state->coef[j][d], piece);
+        }
+
+        bytes += piece;
+        length -= piece;
+        state->stripe_fill += piece;
+        state->total += piece;
+        if (state->stripe_fill == stripe_size && parity_flush_stripe(state) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Flush the last (partial) stripe, record the size and mtime of the
+ * written file (dest_fd, after its last write), close
+ *
+ * Missing data in the last stripe counts as zeros.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int parity_finish(struct parity_state *state, int dest_fd) {
+    int failed = 0;
+    struct stat dest_stat;
+    if (state->stripe_fill > 0 && parity_flush_stripe(state) == -1) {
+        failed = 1;
+    }
+    if (fstat(dest_fd, &dest_stat) == -1 ||
+        (unsigned long long)dest_stat.st_size != state->total) {
+        failed = 1;
+    }
+    for (int j = 0; j < state->m; j++) {
+        struct parity_header header;
+        parity_fill_header(&header, state->k, state->m, j, &dest_stat);
+        if (pwrite(state->fds[j], &header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+            failed = 1;
+        }
+        if (close(state->fds[j]) == -1) {
+            failed = 1;
+        }
+        state->fds[j] = -1;
+    }
+    return failed ? -1 : 0;
+}
+
+/*
+ * The copy failed after parity_open(): close and delete the parity
+ * files, so no parity is left behind for a destination that is not a
+ * good copy
+ */
+void parity_abort(struct parity_state *state, const char *dest_file) {
+    for (int j = 0; j < state->m; j++) {
+        if (state->fds[j] != -1) {
+            close(state->fds[j]);
+            state->fds[j] = -1;
+        }
+    }
+    remove_parity_files(dest_file, 1);
+}
+
+/*
+ * Helper function: Invert a K x K matrix over GF(2^8) (Gauss-Jordan)
+ *
+ * Returns 0 on success, -1 if the matrix is singular (cannot happen for
+ * rows of [identity; Cauchy], but we check anyway).
+ */
+int gf_invert_matrix(unsigned char a[][MAX_DATA_BLOCKS], unsigned char inv[][MAX_DATA_BLOCKS], int k) {
+    for (int r = 0; r < k; r++) {
+        for (int c = 0; c < k; c++) {
+            inv[r][c] = (r == c) ? 1 : 0;
+        }
+    }
+    for (int col = 0; col < k; col++) {
+        int pivot = col;
+        while (pivot < k && a[pivot][col] == 0) {
+            pivot++;
+        }
+        if (pivot == k) {
+            return -1;
+        }
+        for (int c = 0; c < k; c++) {
+            unsigned char t = a[col][c];
+            a[col][c] = a[pivot][c];
+            a[pivot][c] = t;
+            t = inv[col][c];
+            inv[col][c] = inv[pivot][c];
+            inv[pivot][c] = t;
+        }
+        unsigned char scale = gf_inv(a[col][col]);
+        for (int c = 0; c < k; c++) {
+            a[col][c] = gf_mul(a[col][c], scale);
+            inv[col][c] = gf_mul(inv[col][c], scale);
+        }
+        for (int r = 0; r < k; r++) {
+            unsigned char factor = a[r][col];
+            if (r != col && factor != 0) {
+                for (int c = 0; c < k; c++) {
+                    a[r][c] ^= gf_mul(factor, a[col][c]);
+                    inv[r][c] ^= gf_mul(factor, inv[col][c]);
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Rebuild damaged parts of a file from its parity files (--repair)
+ *
+ * For every stripe: read the K data blocks and check them against the
+ * CRCs stored in the parity records, and check each parity record's own
+ * CRC. Damaged data blocks are "erasures": if there are at least as many
+ * good parity blocks as bad data blocks, we take any K good blocks, invert
+ * the matching K rows of [identity; Cauchy] and solve for the bad blocks,
+ * which are written back in place.
+ *
+ * The parity files must have been made for this very file: a different
+ * size or mtime means it was rewritten since (e.g. by a copy without
+ * --parity), and "repairing" it would bring back the old data. Bit rot
+ * changes neither. After writing, the mtime is set back to the recorded
+ * one, so the file still matches its parity.
+ *
+ * Returns 0 if the file is intact or fully repaired, 1 otherwise.
+ */
+int repair_file(const char *file) {
+    struct parity_header header = {0};  // Filled from the first good parity file
+    struct parity_state state;
+    int found = -1;
+    int fds[MAX_PARITY_BLOCKS];
+
+    parity_init_tables();
+
+    /*
+     * Open every parity file we can find and take K, M and the size
+     * from the first one with a sane header
+     */
+    for (int j = 0; j < MAX_PARITY_BLOCKS; j++) {
+        char path[PATH_LENGTH];
+        struct parity_header h;
+        fds[j] = -1;
+        if (parity_path(file, j + 1, path) == -1) {
+            continue;
+        }
+        fds[j] = open(path, O_RDONLY);
+        if (fds[j] == -1) {
+            continue;
+        }
+        if (pread(fds[j], &h, sizeof(h), 0) != (ssize_t)sizeof(h) ||
+            skip_prefix(h.magic, "MYCPPAR1") == 0 || h.index != (unsigned int)j ||
+            h.block_size != PARITY_BLOCK || h.k < 1 || h.k > MAX_DATA_BLOCKS ||
+            h.m < 1 || h.m > MAX_PARITY_BLOCKS) {
+            close(fds[j]);
+            fds[j] = -1;
+            continue;
+        }
+        if (found == -1) {
+            header = h;
+            found = j;
+        }
+    }
+    if (found == -1) {
+        message_begin();
+        message_text("Error: No parity files found for '");
+        message_text(file);
+        message_text("'\n");
+        message_send(STDERR_FILENO);
+        return 1;
+    }
+
+    int k = (int)header.k;
+    int m = (int)header.m;
+    parity_matrix(k, m, state.coef);
+
+    int fd = open(file, O_RDWR);
+    if (fd == -1) {
+        message_begin();
+        message_text("Error: Cannot open '");
+        message_text(file);
+        message_text("' for repair\n");
+        message_send(STDERR_FILENO);
+        return 1;
+    }
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1 ||
+        (unsigned long long)file_stat.st_size != header.file_size ||
+        (long long)file_stat.st_mtim.tv_sec != header.mtime_sec ||
+        (long long)file_stat.st_mtim.tv_nsec != header.mtime_nsec) {
+        message_begin();
+        message_text("Error: '");
+        message_text(file);
+        message_text("' has changed since its parity files were made (size or mtime differs)\n");
+        message_send(STDERR_FILENO);
+        close(fd);
+        for (int j = 0; j < MAX_PARITY_BLOCKS; j++) {
+            if (fds[j] != -1) {
+                close(fds[j]);
+            }
+        }
+        return 1;
+    }
+
+    unsigned long long stripe_size = (unsigned long long)k * PARITY_BLOCK;
+    unsigned long long stripes = (header.file_size + stripe_size - 1) / stripe_size;
+    unsigned long long record_size = sizeof(unsigned int) * (k + 1) + PARITY_BLOCK;
+    unsigned long long repaired = 0;
+    unsigned long long lost = 0;
+
+    for (unsigned long long s = 0; s < stripes; s++) {
+        unsigned int crcs[MAX_DATA_BLOCKS];
+        int have_crcs = 0;
+        int parity_good[MAX_PARITY_BLOCKS];
+
+        /*
+         * Read and check the parity records
+         */
+        for (int j = 0; j < m; j++) {
+            parity_good[j] = 0;
+            if (fds[j] == -1) {
+                continue;
+            }
+            unsigned int list[MAX_DATA_BLOCKS];
+            unsigned int stored_crc;
+            off_t at = (off_t)(sizeof(header) + s * record_size);
+            ssize_t list_size = (ssize_t)(sizeof(unsigned int) * k);
+            if (pread(fds[j], list, list_size, at) != list_size ||
+                pread(fds[j], &stored_crc, sizeof(stored_crc), at + list_size) !=
+                    (ssize_t)sizeof(stored_crc) ||
+                pread(fds[j], parity_blocks[j], PARITY_BLOCK,
+                      at + list_size + (off_t)sizeof(stored_crc)) != PARITY_BLOCK) {
+                continue;
+            }
+            unsigned int crc = crc32_update(0, (const unsigned char *)list, list_size);
+            crc = crc32_update(crc, parity_blocks[j], PARITY_BLOCK);
+            if (crc != stored_crc) {
+                continue;
+            }
+            parity_good[j] = 1;
+            if (!have_crcs) {
+                for (int d = 0; d < k; d++) {
+                    crcs[d] = list[d];
+                }
+                have_crcs = 1;
+            }
+        }
+        if (!have_crcs) {
+            lost++;  // No trustworthy record - cannot even tell what is damaged
+            continue;
+        }
+
+        /*
+         * Read and check the data blocks (zeros past the end of the file)
+         */
+        int bad[MAX_DATA_BLOCKS];
+        size_t lengths[MAX_DATA_BLOCKS];
+        int bad_count = 0;
+        for (int d = 0; d < k; d++) {
+            unsigned long long offset = s * stripe_size + (unsigned long long)d * PARITY_BLOCK;
+            unsigned long long length = 0;
+            if (offset < header.file_size) {
+                length = header.file_size - offset;
+                if (length > PARITY_BLOCK) {
+                    length = PARITY_BLOCK;
+                }
+            }
+            lengths[d] = (size_t)length;
+            for (int i = 0; i < PARITY_BLOCK; i++) {
+                data_blocks[d][i] = 0;
+            }
+            ssize_t got = length ? pread(fd, data_blocks[d], (size_t)length, (off_t)offset) : 0;
+            bad[d] = got != (ssize_t)length ||
+                     crc32_update(0, data_blocks[d], (size_t)length) != crcs[d];
+            if (bad[d]) {
+                bad_count++;
+            }
+        }
+        if (bad_count == 0) {
+            continue;
+        }
+
+        /*
+         * Pick K good rows: good data blocks first, then good parity
+         */
+        unsigned char rows[MAX_DATA_BLOCKS][MAX_DATA_BLOCKS];
+        unsigned char inverse[MAX_DATA_BLOCKS][MAX_DATA_BLOCKS];
+        const unsigned char *sources[MAX_DATA_BLOCKS];
+        int used = 0;
+        for (int d = 0; d < k && used < k; d++) {
+            if (!bad[d]) {
+                for (int c = 0; c < k; c++) {
+                    rows[used][c] = (c == d) ? 1 : 0;
+                }
+                sources[used++] = data_blocks[d];
+            }
+        }
+        for (int j = 0; j < m && used < k; j++) {
+            if (parity_good[j]) {
+                for (int c = 0; c < k; c++) {
+                    rows[used][c] = state.coef[j][c];
+                }
+                sources[used++] = parity_blocks[j];
+            }
+        }
+        if (used < k || gf_invert_matrix(rows, inverse, k) == -1) {
+            lost++;
+            continue;
+        }
+
+        /*
+         * Solve for each bad block and write it back in place
+         */
+        for (int d = 0; d < k; d++) {
+            if (!bad[d] || lengths[d] == 0) {
+                continue;
+            }
+            unsigned char *out = (unsigned char *)buffer;
+            for (int i = 0; i < PARITY_BLOCK; i++) {
+                out[i] = 0;
+            }
+            for (int r = 0; r < k; r++) {
+                gf_mul_add(out, sources[r], inverse[d][r], PARITY_BLOCK);
+            }
+            off_t offset = (off_t)(s * stripe_size + (unsigned long long)d * PARITY_BLOCK);
+            if (pwrite(fd, out, lengths[d], offset) != (ssize_t)lengths[d]) {
+                lost++;
+                continue;
+            }
+            repaired++;
+        }
+    }
+
+    for (int j = 0; j < MAX_PARITY_BLOCKS; j++) {
+        if (fds[j] != -1) {
+            close(fds[j]);
+        }
+    }
+    if (repaired > 0) {
+        struct timespec times[2];
+        times[0].tv_sec = 0;
+        times[0].tv_nsec = UTIME_OMIT;  // Leave the access time alone
+        times[1] = file_stat.st_mtim;
+        if (futimens(fd, times) == -1) {
+            lost++;
+        }
+    }
+    if (close(fd) == -1) {
+        lost++;
+    }
+
+    message_begin();
+    message_text("Repair of '");
+    message_text(file);
+    message_text("': ");
+    message_number(repaired);
+    message_text(" damaged blocks rebuilt, ");
+    message_number(lost);
+    message_text(" unrecoverable\n");
+    message_send(STDOUT_FILENO);
+    return lost == 0 ? 0 : 1;
+}
+
+/*
+ * Helper function: Is this an option that must be followed by a value?
+ *
+ * Such an option given last on the command line reaches the "unknown
+ * option" branch of run(); this lets it say what is really wrong.
+ */
+int takes_value(const char *option) {
+    const char *options[] = {
+        "--calibrate", "--stage-dir", "--drain-rate", "--parity", "--repair",
+        "--replica", "--shard", "--simulate-device", "--link-dest", "--rescue",
+        "--verify", "--analyze"
+    };
+    for (unsigned int i = 0; i < sizeof(options) / sizeof(options[0]); i++) {
+        if (strings_equal(option, options[i])) {
+            return 1;
+        }
+    }
+    return 0;
 }
 
-int main(int argc, char *argv[]) {
+int run(int argc, char *argv[], char *envp[]) {
     /*
      * Step 1: Check command-line arguments
      * 
      * argc = argument count (includes program name)
      * argv = argument vector (array of strings)
      * 
-     * Expected:
-     * argv[0] = "./my_copy" (program name)
-     * argv[1] = source file name
-     * argv[2] = destination file name
+     * Options start with "--" and may appear anywhere.
+     * Everything else is a file name:
+     * first = source file name
+     * second = destination file name
      * 
-     * So argc should be 3
+     * "--calibrate <directory>", "--repair <file>" and "--analyze <file>"
+     * need no file names at all.
+     */
+    char usage[] = "Usage: ./my_copy [--quiet] [--snapshot] [--cache-report] [--stage-dir <dir> [--drain-rate <MB/s>]]\n"
+                   "                 [--parity <K+M>] [--replica <copy_of_source>]...\n"
+                   "                 [--shard <I/N> [--leases]] [--simulate-device <lat_us,seek_us_per_gb,MB/s>]\n"
+                   "                 [--link-dest <previous_backup_dir> [--link-compare]] [--rescue <map_file>]\n"
+                   "                 [--verify sample:<percent>[:<seed>]] [--sha256]\n"
+                   "                 <source_file> <destination_file>\n"
+                   "       ./my_copy --calibrate <directory>\n"
+                   "       ./my_copy --repair <file>\n"
+                   "       ./my_copy --analyze <file>\n";
+    char *files[2];
+    int file_count = 0;
+    char *calibrate_dir = 0;
+    int snapshot = 0;
+    int cache_report = 0;
+    char *stage_dir = 0;
+    unsigned long long drain_rate_kb = 0;
+    int parity_k = 0;
+    int parity_m = 0;
+    char *repair_target = 0;
+    char *replicas[MAX_REPLICAS - 1];
+    int replica_count = 0;
+    unsigned long long shard_index = 0;
+    unsigned long long shard_count = 0;  // 0 = not sharded
+    int use_leases = 0;
+    int simulate = 0;
+    char *link_dest = 0;
+    int link_compare = 0;
+    char *rescue_map = 0;
+    unsigned long long verify_ppm = 0;  // 0 = no --verify
+    unsigned long long verify_seed = 1;
+    int want_sha256 = 0;
+    char *analyze_target = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strings_equal(argv[i], "--calibrate") && i + 1 < argc) {
+            calibrate_dir = argv[++i];
+        }
+        else if (strings_equal(argv[i], "--snapshot")) {
+            snapshot = 1;
+        }
+        else if (strings_equal(argv[i], "--quiet")) {
+            quiet = 1;
+        }
+        else if (strings_equal(argv[i], "--cache-report")) {
+            cache_report = 1;
+        }
+        else if (strings_equal(argv[i], "--stage-dir") && i + 1 < argc) {
+            stage_dir = argv[++i];
+        }
+        else if (strings_equal(argv[i], "--drain-rate") && i + 1 < argc) {
+            int pos = 0;
+            i++;
+            if (parse_number(argv[i], &pos, &drain_rate_kb) == -1 || argv[i][pos] != '\0') {
+                error_message("Error: --drain-rate needs a number of MB/s\n");
+                return 1;
+            }
+            drain_rate_kb *= 1024;
+        }
+        else if (strings_equal(argv[i], "--parity") && i + 1 < argc) {
+            if (parse_parity_spec(argv[++i], &parity_k, &parity_m) == -1) {
+                error_message("Error: --parity needs K+M with 1 <= K <= 32, 1 <= M <= 16\n");
+                return 1;
+            }
+        }
+        else if (strings_equal(argv[i], "--repair") && i + 1 < argc) {
+            repair_target = argv[++i];
+        }
+        else if (strings_equal(argv[i], "--replica") && i + 1 < argc) {
+            if (replica_count == MAX_REPLICAS - 1) {
+                error_message("Error: Too many --replica options\n");
+                return 1;
+            }
+            replicas[replica_count++] = argv[++i];
+        }
+        else if (strings_equal(argv[i], "--shard") && i + 1 < argc) {
+            if (parse_shard_spec(argv[++i], &shard_index, &shard_count) == -1) {
+                error_message("Error: --shard needs I/N with 0 <= I < N\n");
+                return 1;
+            }
+        }
+        else if (strings_equal(argv[i], "--leases")) {
+            use_leases = 1;
+        }
+        else if (strings_equal(argv[i], "--simulate-device") && i + 1 < argc) {
+            if (parse_device_model(argv[++i], &sim_dest) == -1) {
+                error_message("Error: --simulate-device needs "
+                                            "LATENCY_US,SEEK_US_PER_GB,MB_PER_SEC\n");
+                return 1;
+            }
+            for (int r = 0; r < MAX_REPLICAS; r++) {
+                sim_source[r] = sim_dest;
+                if (r > 0) {
+                    sim_source[r].bad_length = 0;  // Bad area is on the source only
+                }
+            }
+            sim_dest.bad_length = 0;
+            simulate = 1;
+        }
+        else if (strings_equal(argv[i], "--link-dest") && i + 1 < argc) {
+            link_dest = argv[++i];
+        }
+        else if (strings_equal(argv[i], "--link-compare")) {
+            link_compare = 1;
+        }
+        else if (strings_equal(argv[i], "--analyze") && i + 1 < argc) {
+            analyze_target = argv[++i];
+        }
+        else if (strings_equal(argv[i], "--sha256")) {
+            want_sha256 = 1;
+        }
+        else if (strings_equal(argv[i], "--rescue") && i + 1 < argc) {
+            rescue_map = argv[++i];
+        }
+        else if ((strings_equal(argv[i], "--verify") && i + 1 < argc) ||
+                 skip_prefix(argv[i], "--verify=") != 0) {
+            // Both "--verify sample:P" and "--verify=sample:P"
+            const char *spec = skip_prefix(argv[i], "--verify=");
+            if (spec == 0) {
+                spec = argv[++i];
+            }
+            if (parse_verify_spec(spec, &verify_ppm, &verify_seed) == -1) {
+                error_message("Error: --verify needs sample:P[:SEED] "
+                                            "with 0 < P <= 100\n");
+                return 1;
+            }
+        }
+        else if (argv[i][0] == '-' && argv[i][1] == '-') {
+            message_begin();
+            message_text(takes_value(argv[i]) ? "Error: Option '" : "Error: Unknown option '");
+            message_text(argv[i]);
+            message_text(takes_value(argv[i]) ? "' needs a value\n" : "'\n");
+            message_send(STDERR_FILENO);
+            error_message(usage);
+            return 1;
+        }
+        else if (file_count < 2) {
+            files[file_count++] = argv[i];
+        }
+        else {
+            file_count = 3;  // Too many file names
+        }
+    }
+
+    /*
+     * Find the profile cache ($MY_COPY_PROFILES or $HOME/.my_copy_profiles)
      */
-    if (argc != 3) {
-        char usage[] = "Usage: ./my_copy <source_file> <destination_file>\n";
-        write(STDERR_FILENO, usage, sizeof(usage) - 1);
+    char profile_path[PATH_LENGTH];
+    char profiles[PROFILE_FILE_SIZE];
+    int have_profiles = find_profile_path(envp, profile_path) == 0;
+
+    if (calibrate_dir != 0) {
+        if (file_count != 0) {
+            error_message(usage);
+            return 1;
+        }
+        if (!have_profiles) {
+            error_message("Error: Set HOME or MY_COPY_PROFILES to store profiles\n");
+            return 1;
+        }
+        return calibrate(calibrate_dir, profile_path);
+    }
+
+    if (repair_target != 0) {
+        if (file_count != 0) {
+            error_message(usage);
+            return 1;
+        }
+        return repair_file(repair_target);
+    }
+
+    if (analyze_target != 0) {
+        if (file_count != 0) {
+            error_message(usage);
+            return 1;
+        }
+        profiles[0] = '\0';
+        if (have_profiles) {
+            load_profiles(profile_path, profiles);
+        }
+        return analyze_file(analyze_target, profiles);
+    }
+
+    if (file_count != 2) {
+        error_message(usage);
+        return 1;
+    }
+
+    if (shard_count > 0 && (parity_k > 0 || replica_count > 0 || stage_dir != 0)) {
+        error_message("Error: --shard cannot be combined with --parity, "
+                                    "--replica or --stage-dir\n");
+        return 1;
+    }
+    if (link_dest != 0 && (shard_count > 0 || parity_k > 0 || stage_dir != 0)) {
+        error_message("Error: --link-dest cannot be combined with --shard, "
+                                    "--parity or --stage-dir\n");
+        return 1;
+    }
+    if (rescue_map != 0 && (shard_count > 0 || parity_k > 0 || stage_dir != 0 ||
+                            replica_count > 0 || link_dest != 0 || snapshot)) {
+        error_message("Error: --rescue cannot be combined with --shard, --parity, "
+                                    "--stage-dir, --replica, --link-dest or --snapshot\n");
+        return 1;
+    }
+    if (verify_ppm > 0 && (shard_count > 0 || stage_dir != 0 || rescue_map != 0)) {
+        error_message("Error: --verify cannot be combined with --shard, "
+                                    "--stage-dir or --rescue\n");
+        return 1;
+    }
+    if (want_sha256 && (shard_count > 0 || rescue_map != 0)) {
+        error_message("Error: --sha256 cannot be combined with --shard or --rescue\n");
+        return 1;
+    }
+    if (link_compare && link_dest == 0) {
+        error_message("Error: --link-compare only makes sense with --link-dest\n");
+        return 1;
+    }
+    if (use_leases && shard_count == 0) {
+        error_message("Error: --leases only makes sense with --shard\n");
         return 1;
     }
+
+    profiles[0] = '\0';
+    if (have_profiles) {
+        load_profiles(profile_path, profiles);
+    }
     
     /*
      * Store the file names in readable variables
-     * argv[1] = source file
-     * argv[2] = destination file
      */
-    char *source_file = argv[1];
-    char *dest_file = argv[2];
+    char *source_file = files[0];
+    char *dest_file = files[1];
     
     /*
      * Step 2: Check if destination file already exists
@@ -63,18 +4248,38 @@ int main(int argc, char *argv[]) {
      * F_OK = just check if file exists
      * 
      * Returns 0 if file exists, -1 if it doesn't (or other error)
+     * 
+     * With --shard the other shards create the same destination, so
+     * finding it there is expected: an empty file, or one already at the
+     * source's size (every shard sets that size before copying), is
+     * taken to be theirs. Any other file is not, and we ask. Resuming a
+     * --rescue never asks: its map file exists.
      */
-    if (access(dest_file, F_OK) == 0) {
+    int resume_rescue = rescue_map != 0 && access(rescue_map, F_OK) == 0;
+    int ask_overwrite = !resume_rescue;
+    if (shard_count > 0) {
+        struct stat source_check;
+        struct stat dest_check;
+        ask_overwrite = stat(dest_file, &dest_check) == 0 && dest_check.st_size != 0 &&
+                        (stat(source_file, &source_check) == -1 ||
+                         dest_check.st_size != source_check.st_size);
+    }
+    // A character device or pipe has nothing to lose, and the question would land in the data
+    struct stat existing;
+    if (stat(dest_file, &existing) == 0 &&
+        (S_ISCHR(existing.st_mode) || S_ISFIFO(existing.st_mode) || S_ISSOCK(existing.st_mode))) {
+        ask_overwrite = 0;
+    }
+    if (ask_overwrite && access(dest_file, F_OK) == 0) {
         /*
          * Destination file exists!
          * We need to ask the user if they want to overwrite it.
          */
-        char prompt1[] = "Destination file '";
-        char prompt2[] = "' already exists. Copying will overwrite it. Continue? (y/n): ";
-        
-        write(STDOUT_FILENO, prompt1, sizeof(prompt1) - 1);
-        write(STDOUT_FILENO, dest_file, string_length(dest_file));
-        write(STDOUT_FILENO, prompt2, sizeof(prompt2) - 1);
+        message_begin();
+        message_text("Destination file '");
+        message_text(dest_file);
+        message_text("' already exists. Copying will overwrite it. Continue? (y/n): ");
+        message_send(STDOUT_FILENO);
         
         /*
          * Read user's response
@@ -88,12 +4293,19 @@ int main(int argc, char *argv[]) {
             /*
              * Read one character from stdin (file descriptor 0)
              * The user will type 'y' or 'n' followed by Enter
+             * 
+             * The question must be on screen before we wait for the answer
              */
+            flush_output();
             ssize_t bytes_read = read(STDIN_FILENO, &response, 1);
             
             if (bytes_read == -1) {
-                char error[] = "Error: Failed to read user input\n";
-                write(STDERR_FILENO, error, sizeof(error) - 1);
+                error_message("Error: Failed to read user input\n");
+                return 1;
+            }
+            if (bytes_read == 0) {
+                // stdin is closed (e.g. < /dev/null): nobody will ever answer
+                error_message("\nError: No answer on stdin - not overwriting\n");
                 return 1;
             }
             
@@ -109,19 +4321,22 @@ int main(int argc, char *argv[]) {
             if (response == 'y' || response == 'Y') {
                 // User confirmed - we'll continue with the copy
                 valid_input = 1;
-                char msg[] = "Proceeding with copy...\n";
-                write(STDOUT_FILENO, msg, sizeof(msg) - 1);
+                message_begin();
+                message_text("Proceeding with copy...\n");
+                message_send(STDOUT_FILENO);
             }
             else if (response == 'n' || response == 'N') {
                 // User cancelled - exit the program
-                char msg[] = "Copy cancelled by user.\n";
-                write(STDOUT_FILENO, msg, sizeof(msg) - 1);
+                message_begin();
+                message_text("Copy cancelled by user.\n");
+                message_send(STDOUT_FILENO);
                 return 0;  // Exit successfully (user's choice)
             }
             else {
                 // Invalid input - ask again
-                char msg[] = "Invalid input. Please enter 'y' or 'n': ";
-                write(STDOUT_FILENO, msg, sizeof(msg) - 1);
+                message_begin();
+                message_text("Invalid input. Please enter 'y' or 'n': ");
+                message_send(STDOUT_FILENO);
             }
         }
     }
@@ -138,14 +4353,120 @@ int main(int argc, char *argv[]) {
     
     if (source_fd == -1) {
         // Error opening source file
-        char error1[] = "Error: Cannot open source file '";
-        char error2[] = "'\n";
-        write(STDERR_FILENO, error1, sizeof(error1) - 1);
-        write(STDERR_FILENO, source_file, string_length(source_file));
-        write(STDERR_FILENO, error2, sizeof(error2) - 1);
+        message_begin();
+        message_text("Error: Cannot open source file '");
+        message_text(source_file);
+        message_text("'\n");
+        message_send(STDERR_FILENO);
+        return 1;
+    }
+    
+    /*
+     * Remember the source's size and mtime now: a --snapshot clone has a
+     * new mtime, but --link-dest and --replica must compare against the
+     * real file
+     */
+    struct stat original_stat;
+    if (fstat(source_fd, &original_stat) == -1) {
+        error_message("Error: Cannot get source file information\n");
+        close(source_fd);
+        return 1;
+    }
+    
+    /*
+     * With --link-dest, an unchanged file is linked to the previous
+     * backup instead of copied (see link_previous())
+     */
+    if (link_dest != 0) {
+        int linked = link_previous(link_dest, dest_file, source_fd,
+                                   &original_stat, link_compare);
+        if (linked != 0) {
+            // No data was copied, so --sha256 has to read the source
+            char digest[65];
+            int hashed = linked == 1 && want_sha256 && sha256_file(source_fd, digest) == 0;
+            close(source_fd);
+            if (linked == 1 && !quiet) {
+                message_begin();
+                message_text("Success! Linked '");
+                message_text(dest_file);
+                message_text("' to the unchanged copy in '");
+                message_text(link_dest);
+                message_text("'\n");
+                message_send(STDOUT_FILENO);
+            }
+            if (hashed) {
+                print_sha256(digest, dest_file);
+            }
+            else if (linked == 1 && want_sha256) {
+                error_message("Error: Failed to read source file for --sha256\n");
+                return 1;
+            }
+            return linked == 1 ? 0 : 1;
+        }
+        if (unshare_destination(dest_file) == -1) {
+            close(source_fd);
+            return 1;
+        }
+    }
+    
+    /*
+     * With --snapshot, copy from a reflinked clone of the source instead
+     * of the live file (see snapshot_source())
+     */
+    if (snapshot) {
+        int snapshot_fd = snapshot_source(source_fd, source_file);
+        close(source_fd);
+        if (snapshot_fd == -1) {
+            return 1;
+        }
+        source_fd = snapshot_fd;
+    }
+    
+    /*
+     * Preflight: refuse a copy that cannot fit, before Step 4 truncates
+     * anything (see preflight_check() for what is counted)
+     */
+    int truncates = shard_count == 0 && !resume_rescue;
+    if (preflight_check(source_fd, dest_file, truncates, profiles) == -1) {
+        close(source_fd);
+        return 1;
+    }
+    
+    /*
+     * With --replica, check and open the replicas now - before Step 4
+     * truncates anything - so a mismatched replica costs nothing
+     */
+    struct copy_source source;
+    source.fd = source_fd;
+    if (replica_count > 0 &&
+        open_replicas(&source, source_file, &original_stat, replicas, replica_count) == -1) {
+        close(source_fd);
         return 1;
     }
     
+    /*
+     * With --stage-dir, write to a file in the (fast) staging area
+     * instead, once it has room for us. It is moved to dest_file in the
+     * background after the copy (see start_drain()).
+     */
+    char stage_path[PATH_LENGTH];
+    char *write_path = dest_file;
+
+    if (stage_dir != 0) {
+        int pos = append_string(stage_path, 0, stage_dir);
+        pos = append_string(stage_path, pos, "/.my_copy-stage-");
+        if (append_number(stage_path, pos, (unsigned long long)getpid()) == -1) {
+            error_message("Error: Staging path is too long\n");
+            close(source_fd);
+            return 1;
+        }
+        if (wait_for_stage_space(stage_dir, source_fd) == -1) {
+            close(source_fd);
+            return 1;
+        }
+        write_path = stage_path;
+    }
+    
     /*
      * Step 4: Create/open the destination file for writing
      * 
@@ -155,16 +4476,24 @@ int main(int argc, char *argv[]) {
      * - O_TRUNC:  Truncate (empty) the file if it exists
      * 
      * Mode 0644: rw-r--r-- (owner can read/write, others can read)
+     * 
+     * With --shard there is no O_TRUNC: the other shards may already be
+     * writing their chunks into this file. Nor when resuming a --rescue:
+     * the data rescued so far is in it.
      */
-    int dest_fd = open(dest_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int open_flags = O_WRONLY | O_CREAT | (truncates ? O_TRUNC : 0);
+    if (stage_dir != 0) {
+        open_flags |= O_EXCL;  // Never share a stage file with another run
+    }
+    int dest_fd = open(write_path, open_flags, 0644);
     
     if (dest_fd == -1) {
         // Error opening destination file
-        char error1[] = "Error: Cannot create destination file '";
-        char error2[] = "'\n";
-        write(STDERR_FILENO, error1, sizeof(error1) - 1);
-        write(STDERR_FILENO, dest_file, string_length(dest_file));
-        write(STDERR_FILENO, error2, sizeof(error2) - 1);
+        message_begin();
+        message_text("Error: Cannot create destination file '");
+        message_text(write_path);
+        message_text("'\n");
+        message_send(STDERR_FILENO);
         close(source_fd);  // Don't forget to close the source file!
         return 1;
     }
@@ -176,30 +4505,183 @@ int main(int argc, char *argv[]) {
      * and write them to destination.
      * 
      * This is more efficient than reading/writing one byte at a time!
+     * 
+     * Request size: BUFFER_SIZE, unless the destination device (or else
+     * the source device) was measured with --calibrate.
+     */
+    size_t buffer_size = BUFFER_SIZE;
+    struct stat dest_stat;
+    struct stat source_stat;
+    unsigned long long rate;
+
+    if (profiles[0] != '\0') {
+        unsigned long long size = 0;
+        if (fstat(dest_fd, &dest_stat) == 0) {
+            size = lookup_profile(profiles, (unsigned long long)dest_stat.st_dev, &rate);
+        }
+        if (size == 0 && fstat(source_fd, &source_stat) == 0) {
+            size = lookup_profile(profiles, (unsigned long long)source_stat.st_dev, &rate);
+        }
+        if (size >= 512 && size <= MAX_BUFFER_SIZE) {
+            buffer_size = (size_t)size;
+        }
+    }
+
+    /*
+     * --shard: copy only this process's chunks (see copy_shards())
+     */
+    if (shard_count > 0) {
+        unsigned long long chunks_copied;
+        int failed = copy_shards(source_fd, dest_fd, dest_file, shard_index, shard_count,
+                                 use_leases, buffer_size, &chunks_copied) == -1;
+        close(source_fd);
+        if (close(dest_fd) == -1 || failed) {
+            return 1;
+        }
+        if (!quiet) {
+            message_begin();
+            message_text("Success! Shard ");
+            message_number(shard_index);
+            message_text("/");
+            message_number(shard_count);
+            message_text(" copied ");
+            message_number(chunks_copied);
+            message_text(" chunks of '");
+            message_text(source_file);
+            message_text("' to '");
+            message_text(dest_file);
+            message_text("'\n");
+            message_send(STDOUT_FILENO);
+        }
+        if (simulate) {
+            print_device_report(0);
+        }
+        return 0;
+    }
+
+    /*
+     * --rescue: copy what can be read, retry the rest (see rescue_copy())
+     */
+    if (rescue_map != 0) {
+        int result = rescue_copy(source_fd, dest_fd, rescue_map, resume_rescue);
+        close(source_fd);
+        if (close(dest_fd) == -1 || result == -1) {
+            return 1;
+        }
+        if (result == 0 && !quiet) {
+            message_begin();
+            message_text("Success! Rescued all of '");
+            message_text(source_file);
+            message_text("' to '");
+            message_text(dest_file);
+            message_text("'\n");
+            message_send(STDOUT_FILENO);
+        }
+        if (simulate) {
+            print_device_report(0);
+        }
+        return result;
+    }
+
+    /*
+     * --cache-report: take the "before" picture, then keep the peaks
+     * while copying
+     */
+    struct cache_sample cache_before;
+    struct cache_sample cache_now;
+    struct cache_sample cache_peak;
+    long long source_cached_before = -1;
+    unsigned long long bytes_copied = 0;
+    unsigned long long next_sample = CACHE_SAMPLE_BYTES;
+
+    if (cache_report) {
+        long long size;
+        source_cached_before = resident_kb(source_file, &size);
+        if (sample_meminfo(&cache_before) == -1) {
+            error_message("Warning: Cannot read /proc/meminfo - no cache report\n");
+            cache_report = 0;
+        }
+        cache_peak = cache_before;
+    }
+
+    /*
+     * Pick how to read the source: striped across --replica copies if
+     * any were given (set up before Step 4), otherwise from how much of
+     * it is already in the page cache (see choose_strategy())
+     */
+    if (replica_count == 0) {
+        if (simulate) {
+            source.strategy = STRATEGY_BUFFERED;  // Every byte must pass the model
+        }
+        else {
+            choose_strategy(&source, parity_k > 0 || want_sha256);
+        }
+    }
+
+    if (source.strategy == STRATEGY_MAPPED || source.strategy == STRATEGY_REPLICAS) {
+        buffer_size = MAX_BUFFER_SIZE;  // Big writes / big stripes per device
+    }
+    else if (source.strategy == STRATEGY_DIRECT) {
+        buffer_size = (buffer_size + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+    }
+    unsigned long long writeback_started = 0;
+    unsigned long long pages_dropped = 0;
+
+    /*
+     * --parity: parity is computed from the same chunks we write, so the
+     * data is only read once
      */
-    char buffer[BUFFER_SIZE];
+    struct parity_state parity;
+    if (parity_k > 0 && parity_open(&parity, dest_file, parity_k, parity_m) == -1) {
+        close(source_fd);
+        close(dest_fd);
+        return 1;
+    }
+    // Parity files from an earlier copy (or beyond M) would "repair" the new data back to the old
+    remove_parity_files(dest_file, parity_k > 0 ? parity_m + 1 : 1);
+
+    struct sha256_state digest;
+    if (want_sha256) {
+        sha256_init(&digest);
+    }
+
+    const char *data;
     ssize_t bytes_read;
     
     /*
      * Read loop:
-     * - read() returns the number of bytes actually read
+     * - read_chunk() returns the number of bytes actually read
      * - Returns 0 when we reach end of file (EOF)
      * - Returns -1 on error
      */
-    while ((bytes_read = read(source_fd, buffer, BUFFER_SIZE)) > 0) {
+    while ((bytes_read = read_chunk(&source, &data, buffer_size)) > 0) {
         /*
          * Write what we just read to the destination file
          * 
          * Important: write exactly bytes_read bytes,
-         * not BUFFER_SIZE (the last chunk might be smaller!)
+         * not buffer_size (the last chunk might be smaller!)
+         */
+        ssize_t bytes_written = dev_write(&sim_dest, dest_fd, data, bytes_read);
+        
+        /*
+         * Writing from the mapping fails (EFAULT) or stops short if the
+         * source was truncated since read_chunk() checked it: keep what
+         * was written and go on with read() from there
          */
-        ssize_t bytes_written = write(dest_fd, buffer, bytes_read);
+        if (bytes_written != bytes_read && source.strategy == STRATEGY_MAPPED) {
+            ssize_t done = bytes_written > 0 ? bytes_written : 0;
+            stop_mapping(&source, source.offset - (unsigned long long)(bytes_read - done));
+            bytes_copied += done;
+            continue;
+        }
         
         if (bytes_written == -1) {
-            char error[] = "Error: Failed to write to destination file\n";
-            write(STDERR_FILENO, error, sizeof(error) - 1);
+            error_message("Error: Failed to write to destination file\n");
             close(source_fd);
             close(dest_fd);
+            if (parity_k > 0) {
+                parity_abort(&parity, dest_file);
+            }
             return 1;
         }
         
@@ -208,22 +4690,117 @@ int main(int argc, char *argv[]) {
          * (This should always be true for regular files)
          */
         if (bytes_written != bytes_read) {
-            char error[] = "Error: Incomplete write\n";
-            write(STDERR_FILENO, error, sizeof(error) - 1);
+            error_message("Error: Incomplete write\n");
+            close(source_fd);
+            close(dest_fd);
+            if (parity_k > 0) {
+                parity_abort(&parity, dest_file);
+            }
+            return 1;
+        }
+
+        if (parity_k > 0 && parity_add(&parity, data, bytes_written) == -1) {
+            error_message("Error: Failed to write parity file\n");
             close(source_fd);
             close(dest_fd);
+            if (parity_k > 0) {
+                parity_abort(&parity, dest_file);
+            }
             return 1;
         }
+
+        if (want_sha256) {
+            sha256_update(&digest, data, (size_t)bytes_written);
+        }
+
+        bytes_copied += bytes_written;
+        if (source.strategy == STRATEGY_DIRECT) {
+            drop_written_pages(dest_fd, bytes_copied, &writeback_started, &pages_dropped);
+        }
+        if (cache_report && bytes_copied >= next_sample) {
+            next_sample = bytes_copied + CACHE_SAMPLE_BYTES;
+            if (sample_meminfo(&cache_now) == 0) {
+                if (cache_now.dirty > cache_peak.dirty) {
+                    cache_peak.dirty = cache_now.dirty;
+                }
+                if (cache_now.writeback > cache_peak.writeback) {
+                    cache_peak.writeback = cache_now.writeback;
+                }
+            }
+        }
     }
     
     /*
      * Check if read() failed (vs. just reaching EOF)
      */
     if (bytes_read == -1) {
-        char error[] = "Error: Failed to read from source file\n";
-        write(STDERR_FILENO, error, sizeof(error) - 1);
+        error_message("Error: Failed to read from source file\n");
+        close(source_fd);
+        close(dest_fd);
+        if (parity_k > 0) {
+            parity_abort(&parity, dest_file);
+        }
+        return 1;
+    }
+    
+    if (parity_k > 0 && parity_finish(&parity, dest_fd) == -1) {
+        error_message("Error: Failed to write parity file\n");
+        close(source_fd);
+        close(dest_fd);
+        parity_abort(&parity, dest_file);
+        return 1;
+    }
+    
+    if (source.strategy == STRATEGY_MAPPED) {
+        munmap((void *)source.map, (size_t)source.size);
+    }
+    else if (source.strategy == STRATEGY_REPLICAS) {
+        close_replicas(&source);
+    }
+    else if (source.strategy == STRATEGY_DIRECT) {
+        // Drop whatever has already been written back
+        posix_fadvise(dest_fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    
+    /*
+     * With --link-dest, give the copy the source's mtime so the next
+     * generation can recognise it as unchanged
+     */
+    if (link_dest != 0) {
+        struct timespec times[2];
+        times[0].tv_sec = 0;
+        times[0].tv_nsec = UTIME_OMIT;  // Leave the access time alone
+        times[1] = original_stat.st_mtim;
+        if (futimens(dest_fd, times) == -1) {
+            error_message("Warning: Cannot set destination mtime - "
+                                        "the next --link-dest run will copy it again\n");
+        }
+    }
+    
+    /*
+     * With --verify, spot-check the copy (see verify_sample())
+     */
+    if (verify_ppm > 0 && verify_sample(source_fd, dest_file, verify_ppm, verify_seed) == -1) {
+        close(source_fd);
+        close(dest_fd);
+        if (parity_k > 0) {
+            parity_abort(&parity, dest_file);
+        }
+        return 1;
+    }
+    
+    /*
+     * With --stage-dir, "Success! Staged" promises the data is safe in
+     * the staging area - make it true before we say it
+     */
+    if (stage_dir != 0 && fdatasync(dest_fd) == -1) {
+        error_message("Error: Failed to flush the staged file\n");
         close(source_fd);
         close(dest_fd);
+        unlink(stage_path);
+        if (parity_k > 0) {
+            parity_abort(&parity, dest_file);
+        }
         return 1;
     }
     
@@ -231,29 +4808,85 @@ int main(int argc, char *argv[]) {
      * Step 6: Close both files
      */
     if (close(source_fd) == -1) {
-        char error[] = "Error: Failed to close source file\n";
-        write(STDERR_FILENO, error, sizeof(error) - 1);
+        error_message("Error: Failed to close source file\n");
         close(dest_fd);
+        if (parity_k > 0) {
+            parity_abort(&parity, dest_file);
+        }
         return 1;
     }
     
     if (close(dest_fd) == -1) {
-        char error[] = "Error: Failed to close destination file\n";
-        write(STDERR_FILENO, error, sizeof(error) - 1);
+        error_message("Error: Failed to close destination file\n");
+        if (parity_k > 0) {
+            parity_abort(&parity, dest_file);
+        }
         return 1;
     }
     
     /*
      * Step 7: Print success message
+     * 
+     * With --stage-dir the data is safe in the staging area, which is
+     * all the caller has to wait for.
+     * 
+     * --quiet drops this line: in bulk runs it is only noise.
+     */
+    if (!quiet) {
+        message_begin();
+        message_text(stage_dir != 0 ? "Success! Staged '" : "Success! Copied '");
+        message_text(source_file);
+        message_text(stage_dir != 0 ? "' for '" : "' to '");
+        message_text(dest_file);
+        message_text(stage_dir != 0 ? "' (moving it there in the background)\n" : "'\n");
+        message_send(STDOUT_FILENO);
+    }
+    
+    /*
+     * --sha256: the digest line, even with --quiet - it was asked for
+     */
+    if (want_sha256) {
+        char hex[65];
+        sha256_final(&digest, hex);
+        print_sha256(hex, dest_file);
+    }
+    
+    /*
+     * Step 8: Page-cache impact (--cache-report)
+     */
+    if (cache_report && sample_meminfo(&cache_now) == 0) {
+        if (cache_now.dirty > cache_peak.dirty) {
+            cache_peak.dirty = cache_now.dirty;
+        }
+        if (cache_now.writeback > cache_peak.writeback) {
+            cache_peak.writeback = cache_now.writeback;
+        }
+        print_cache_report(&cache_before, &cache_now, &cache_peak,
+                           source_cached_before, source_file, write_path);
+    }
+    
+    if (simulate) {
+        print_device_report(replica_count);
+    }
+    
+    /*
+     * Step 9: With --stage-dir, start the background drain to the real
+     * destination and return right away
      */
-    char success1[] = "Success! Copied '";
-    char success2[] = "' to '";
-    char success3[] = "'\n";
-    write(STDOUT_FILENO, success1, sizeof(success1) - 1);
-    write(STDOUT_FILENO, source_file, string_length(source_file));
-    write(STDOUT_FILENO, success2, sizeof(success2) - 1);
-    write(STDOUT_FILENO, dest_file, string_length(dest_file));
-    write(STDOUT_FILENO, success3, sizeof(success3) - 1);
+    if (stage_dir != 0 && start_drain(stage_path, dest_file, drain_rate_kb) == -1) {
+        // Cannot run it in the background - drain now instead
+        return drain_staged(stage_path, dest_file, drain_rate_kb);
+    }
     
     return 0;  // Success!
-}
\ No newline at end of file
+}
+
+/*
+ * Entry point: run the program, then write out any batched output
+ * (see flush_output()) no matter which return path run() took
+ */
+int main(int argc, char *argv[], char *envp[]) {
+    int status = run(argc, argv, envp);
+    flush_output();
+    return status;
+}